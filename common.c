@@ -7,115 +7,262 @@
 #define _POSIX_C_SOURCE 201112L
 #define _XOPEN_SOURCE
 #define _XOPEN_SOURCE_EXTENDED
+#define _DEFAULT_SOURCE
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "common.h"
 
+/* The callbacks that the inline decoder calls. */
+struct callbacks {
+	com_port_option_callback *callback;
+	telnet_option_callback *negotiate;
+};
+
 static void
-com_port_option (const unsigned char *buf, int size, com_port_option_callback callback)
+com_port_option (void *data, enum com_port_option option, union com_port_option_value *value)
 {
-	union com_port_option_value value;
+	struct callbacks *callbacks = data;
 
-	if (size < 6) {
-		fprintf (stderr, "too short: %d\n", size);
-		return;
-	}
+	callbacks->callback (option, value);
+}
 
-	switch (buf[3] - 100) {
-	case SET_BAUDRATE:
-		if (size < 10)
-			return;
-		value.baudrate = (buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | (buf[7] << 0);
-		callback (SET_BAUDRATE, &value);
-		break;
-	case SET_DATASIZE:
-		value.datasize = buf[4];
-		callback (SET_DATASIZE, &value);
-		break;
-	case SET_PARITY:
-		value.parity = buf[4];
-		callback (SET_PARITY, &value);
-		break;
-	case SET_STOPSIZE:
-		value.stopsize = buf[4];
-		callback (SET_STOPSIZE, &value);
-		break;
-	case SET_CONTROL:
-		value.control = buf[4];
-		callback (SET_CONTROL, &value);
-		break;
-	}
+static void
+telnet_option (void *data, int command, int option)
+{
+	struct callbacks *callbacks = data;
+
+	callbacks->negotiate (command, option);
 }
 
 int
-get_esc (const unsigned char *buf, int size, com_port_option_callback callback)
+get_esc (const unsigned char *buf, int size, com_port_option_callback callback, telnet_option_callback negotiate)
 {
-	int i;
+	struct callbacks callbacks = { callback, negotiate };
 
-	if (size < 2)
-		return 0;
+	return rfc2217_get_esc (buf, size,
+		callback ? com_port_option : NULL,
+		negotiate ? telnet_option : NULL,
+		&callbacks);
+}
 
-	if (buf[0] != IAC)
-		return 0;
+/* If the first character is an IAC after the previous get_esc() call
+ * it is not a command. */
+int
+get_data (const unsigned char *buf, int size)
+{
+	return rfc2217_get_data (buf, size);
+}
 
-	switch (buf[1]) {
-	case IAC:
-		/* If we leave IAC IAC, then it's considered as IAC data. */
-		return 0;
-	case WILL:
-		if (size < 3)
-			return 0;
-		return 3;
-	case DO:
-		if (size < 3)
-			return 0;
-		return 3;
-	case SB:
-		for (i = 2; i < size; i++) {
-			if (i + 1 <= size && buf[i] == IAC && buf[i + 1] == SE)
-				break;
+static int
+parse_number (const char *name, const char *value, int *val)
+{
+	if (value[0] == '?') {
+		*val = 0;
+	} else if (value[0] >= '1' && value[0] <= '9') {
+		*val = atoi (value);
+	} else {
+		fprintf (stderr, "Bad %s: '%s'. Expected a non-zero number or '?'.\n", name, value);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Parse a setting in the form netsctl accepts it. The value is what is to
+ * be sent to the server. A '?' requests the current setting and gives 0,
+ * or the CONTROL_REQ_* code of the setting for the SET_CONTROL ones. */
+int
+parse_setting (const char *name, const char *value, enum com_port_option *option, int *val)
+{
+	if (strcmp (name, "baudrate") == 0) {
+		*option = SET_BAUDRATE;
+		return parse_number (name, value, val);
+	} else if (strcmp (name, "datasize") == 0) {
+		*option = SET_DATASIZE;
+		return parse_number (name, value, val);
+	} else if (strcmp (name, "parity") == 0) {
+		*option = SET_PARITY;
+		if (value[0] == '?') {
+			*val = 0;
+		} else if (value[0] >= '1' && value[0] <= '9') {
+			*val = atoi (value);
+		} else if (strcasecmp (value, "NONE") == 0) {
+			*val = 1;
+		} else if (strcasecmp (value, "ODD") == 0) {
+			*val = 2;
+		} else if (strcasecmp (value, "EVEN") == 0) {
+			*val = 3;
+		} else if (strcasecmp (value, "MARK") == 0) {
+			*val = 4;
+		} else {
+			fprintf (stderr, "Bad parity: '%s'. Expected 'NONE', 'ODD', 'EVEN', 'MARK' or '?'.\n", value);
+			return -1;
+		}
+	} else if (strcmp (name, "stopsize") == 0) {
+		*option = SET_STOPSIZE;
+		return parse_number (name, value, val);
+	} else if (strcmp (name, "flow") == 0) {
+		*option = SET_CONTROL;
+		if (value[0] == '?') {
+			*val = CONTROL_REQ_FLOW;
+		} else if (strcmp (value, "none") == 0) {
+			*val = 1;
+		} else if (strcmp (value, "xonxoff") == 0) {
+			*val = 2;
+		} else if (strcmp (value, "rtscts") == 0) {
+			*val = 3;
+		} else {
+			fprintf (stderr, "Bad flow: '%s'. Expected 'none', 'xonxoff', 'rtscts' or '?'.\n", value);
+			return -1;
+		}
+	} else if (strcmp (name, "break") == 0) {
+		*option = SET_CONTROL;
+		if (value[0] == '?') {
+			*val = CONTROL_REQ_BREAK;
+		} else if (strcmp (value, "on") == 0) {
+			*val = 5;
+		} else if (strcmp (value, "off") == 0) {
+			*val = 6;
+		} else {
+			fprintf (stderr, "Bad break: '%s'. Expected 'on', 'off' or '?'.\n", value);
+			return -1;
+		}
+	} else if (strcmp (name, "dtr") == 0) {
+		*option = SET_CONTROL;
+		if (value[0] == '?') {
+			*val = CONTROL_REQ_DTR;
+		} else if (strcmp (value, "on") == 0) {
+			*val = 8;
+		} else if (strcmp (value, "off") == 0) {
+			*val = 9;
+		} else {
+			fprintf (stderr, "Bad dtr: '%s'. Expected 'on', 'off' or '?'.\n", value);
+			return -1;
+		}
+	} else if (strcmp (name, "rts") == 0) {
+		*option = SET_CONTROL;
+		if (value[0] == '?') {
+			*val = CONTROL_REQ_RTS;
+		} else if (strcmp (value, "on") == 0) {
+			*val = 11;
+		} else if (strcmp (value, "off") == 0) {
+			*val = 12;
+		} else {
+			fprintf (stderr, "Bad rts: '%s'. Expected 'on', 'off' or '?'.\n", value);
+			return -1;
 		}
-		if (i == size)
-			return 0;
-		i += 2;
-		if (i < 5)
-			return i;
-		if (buf[2] == COM_PORT_OPTION && callback)
-			com_port_option (buf, i, callback);
-		return i;
+	} else if (strcmp (name, "flow_in") == 0) {
+		*option = SET_CONTROL;
+		if (value[0] == '?') {
+			*val = CONTROL_REQ_FLOW_IN;
+		} else if (strcmp (value, "none") == 0) {
+			*val = 14;
+		} else if (strcmp (value, "xonxoff") == 0) {
+			*val = 15;
+		} else if (strcmp (value, "rtscts") == 0) {
+			*val = 16;
+		} else if (strcmp (value, "dtr") == 0) {
+			*val = 18;
+		} else if (strcmp (value, "dcd") == 0) {
+			*val = 17;
+		} else if (strcmp (value, "dsr") == 0) {
+			*val = 19;
+		} else {
+			fprintf (stderr, "Bad flow_in: '%s'. Expected 'none', 'xonxoff', 'rtscts', 'dtr', 'dcd', 'dsr' or '?'.\n", value);
+			return -1;
+		}
+	} else {
+		fprintf (stderr, "YOLO: [%s] [%s]\n", name, value);
+		return -1;
 	}
 
-	/* Unknown code. Just consume the IAC and command. */
-	return 2;
+	return 0;
 }
 
-/* If the first character is an IAC after the previous get_esc() call
- * it is not a command. */
+/* Encode a COM_PORT_OPTION subnegotiation for the server, at most
+ * RFC2217_PUT_MAX(0) bytes long. Returns the length. */
 int
-get_data (const unsigned char *buf, int size)
+put_com_port_option (unsigned char *buf, enum com_port_option option, int value)
 {
-	int i;
+	union com_port_option_value val;
 
-	if (size == 0)
-		return 0;
-	if (size >= 2 && buf[0] == IAC && buf[1] == IAC)
-		return 1;
-	for (i = 0; i < size; i++) {
-		if (buf[i] == IAC)
-			break;
-	}
+	if (option == SET_BAUDRATE)
+		val.baudrate = value;
+	else
+		val.control = value;
 
-	return i;
+	return rfc2217_put (buf, option, &val);
 }
 
+/* Fill in the address of a UNIX socket. A leading '@' stands for the
+ * abstract namespace. Returns the length of the address, or -1 if the
+ * path is too long. */
 int
-get_socket (const char *host, const char *service)
+unix_address (const char *path, struct sockaddr_un *sun)
+{
+	if (strlen (path) >= sizeof (sun->sun_path))
+		return -1;
+
+	memset (sun, 0, sizeof (*sun));
+	sun->sun_family = AF_UNIX;
+	strcpy (sun->sun_path, path);
+	if (sun->sun_path[0] == '@')
+		sun->sun_path[0] = '\0';
+
+	return offsetof (struct sockaddr_un, sun_path) + strlen (path);
+}
+
+/* A server on the same host, "unix:" followed by the path or the
+ * abstract name. */
+static int
+open_unix_socket (const char *path, int nonblock)
+{
+	struct sockaddr_un sun;
+	int len;
+	int fd;
+
+	len = unix_address (path, &sun);
+	if (len == -1) {
+		fprintf (stderr, "%s: Path too long\n", path);
+		return -1;
+	}
+
+	fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		perror ("socket");
+		return -1;
+	}
+
+	if (nonblock)
+		fcntl (fd, F_SETFL, O_NONBLOCK);
+
+	if (connect (fd, (struct sockaddr *)&sun, len) == -1
+	    && !(nonblock && errno == EINPROGRESS)) {
+		perror (path);
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+open_socket (const char *host, const char *service, int nonblock)
 {
 	int fd;
 	int res;
@@ -123,6 +270,9 @@ get_socket (const char *host, const char *service)
 	struct addrinfo *ai;
 	struct addrinfo *p;
 
+	if (strncmp (host, "unix:", 5) == 0)
+		return open_unix_socket (&host[5], nonblock);
+
 	res = getaddrinfo (host, service, &hints, &ai);
 	if (res != 0) {
 		fprintf (stderr, "%s:%s: %s\n", host, service, gai_strerror (res));
@@ -134,8 +284,11 @@ get_socket (const char *host, const char *service)
 		if (fd == -1)
 			continue;
 
+		if (nonblock)
+			fcntl (fd, F_SETFL, O_NONBLOCK);
+
 		res = connect (fd, p->ai_addr, p->ai_addrlen);
-		if (res != -1)
+		if (res != -1 || (nonblock && errno == EINPROGRESS))
 			break;
 
 		close (fd);
@@ -149,3 +302,71 @@ get_socket (const char *host, const char *service)
 
 	return fd;
 }
+
+int
+get_socket (const char *host, const char *service)
+{
+	return open_socket (host, service, 0);
+}
+
+/* Like get_socket(), but does not wait for the connection to be made.
+ * Once the socket is writable, finish_socket() tells how it went. */
+int
+start_socket (const char *host, const char *service)
+{
+	return open_socket (host, service, 1);
+}
+
+/* Check if the connection started by start_socket() has been made.
+ * If it has, the socket is made blocking like the get_socket() ones. */
+int
+finish_socket (int fd)
+{
+	socklen_t len = sizeof (int);
+	int err;
+
+	if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+		err = errno;
+	if (err) {
+		errno = err;
+		perror ("connect");
+		return -1;
+	}
+
+	fcntl (fd, F_SETFL, 0);
+	return 0;
+}
+
+/* Make the connection fail if the peer does not acknowledge the data sent
+ * within the timeout (in milliseconds). When idle, TCP keepalives are sent
+ * so that a dead peer is noticed within the same time. Nothing to do for
+ * a UNIX socket, the kernel knows when the peer is gone. */
+int
+set_keepalive (int fd, int timeout)
+{
+	unsigned int user_timeout = timeout;
+	socklen_t len = sizeof (int);
+	int domain;
+	int on = 1;
+	int count = 2;
+	int interval;
+
+	if (getsockopt (fd, SOL_SOCKET, SO_DOMAIN, &domain, &len) == 0 && domain == AF_UNIX)
+		return 0;
+
+	/* Idle time followed by the probes add up to the timeout. */
+	interval = timeout / 1000 / (count + 1);
+	if (interval < 1)
+		interval = 1;
+
+	if (setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof (on)) == -1
+	    || setsockopt (fd, IPPROTO_TCP, TCP_KEEPIDLE, &interval, sizeof (interval)) == -1
+	    || setsockopt (fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof (interval)) == -1
+	    || setsockopt (fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof (count)) == -1
+	    || setsockopt (fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &user_timeout, sizeof (user_timeout)) == -1) {
+		perror ("setsockopt");
+		return -1;
+	}
+
+	return 0;
+}
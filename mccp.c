@@ -0,0 +1,114 @@
+/*
+ * Serial port over Telnet stream compression routines
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "mccp.h"
+
+int
+mccp_start_inflate (struct mccp *mccp)
+{
+	int res;
+
+	memset (&mccp->in, 0, sizeof (mccp->in));
+	res = inflateInit (&mccp->in);
+	if (res != Z_OK) {
+		fprintf (stderr, "inflateInit: %s\n", zError (res));
+		return -1;
+	}
+
+	mccp->inflating = 1;
+	return 0;
+}
+
+int
+mccp_start_deflate (struct mccp *mccp)
+{
+	int res;
+
+	memset (&mccp->out, 0, sizeof (mccp->out));
+	res = deflateInit (&mccp->out, Z_DEFAULT_COMPRESSION);
+	if (res != Z_OK) {
+		fprintf (stderr, "deflateInit: %s\n", zError (res));
+		return -1;
+	}
+
+	mccp->deflating = 1;
+	return 0;
+}
+
+/* Decompress as much of the src as fits into dst. The consumed data is
+ * removed from the src. If the server ended the compressed stream, the
+ * inflating flag is cleared and whatever is left in src is plain data. */
+int
+mccp_inflate (struct mccp *mccp, unsigned char *src, int *srcbytes, unsigned char *dst, int dstsize)
+{
+	int res;
+
+	if (*srcbytes == 0 || dstsize == 0)
+		return 0;
+
+	mccp->in.next_in = src;
+	mccp->in.avail_in = *srcbytes;
+	mccp->in.next_out = dst;
+	mccp->in.avail_out = dstsize;
+
+	res = inflate (&mccp->in, Z_SYNC_FLUSH);
+	if (res != Z_OK && res != Z_STREAM_END && res != Z_BUF_ERROR) {
+		fprintf (stderr, "inflate: %s\n", mccp->in.msg ? mccp->in.msg : zError (res));
+		return -1;
+	}
+
+	memmove (src, mccp->in.next_in, mccp->in.avail_in);
+	*srcbytes = mccp->in.avail_in;
+
+	if (res == Z_STREAM_END) {
+		inflateEnd (&mccp->in);
+		mccp->inflating = 0;
+	}
+
+	return dstsize - mccp->in.avail_out;
+}
+
+/* Compress as much of the src as fits into dst. The consumed data is
+ * removed from the src. With Z_SYNC_FLUSH, the flush is complete once
+ * the src is empty and dst was not filled up. */
+int
+mccp_deflate (struct mccp *mccp, unsigned char *src, int *srcbytes, unsigned char *dst, int dstsize, int flush)
+{
+	int res;
+
+	if (dstsize == 0)
+		return 0;
+
+	mccp->out.next_in = src;
+	mccp->out.avail_in = *srcbytes;
+	mccp->out.next_out = dst;
+	mccp->out.avail_out = dstsize;
+
+	res = deflate (&mccp->out, flush);
+	if (res != Z_OK && res != Z_BUF_ERROR) {
+		fprintf (stderr, "deflate: %s\n", mccp->out.msg ? mccp->out.msg : zError (res));
+		return -1;
+	}
+
+	memmove (src, mccp->out.next_in, mccp->out.avail_in);
+	*srcbytes = mccp->out.avail_in;
+
+	return dstsize - mccp->out.avail_out;
+}
+
+void
+mccp_end (struct mccp *mccp)
+{
+	if (mccp->inflating)
+		inflateEnd (&mccp->in);
+	if (mccp->deflating)
+		deflateEnd (&mccp->out);
+	mccp->inflating = 0;
+	mccp->deflating = 0;
+}
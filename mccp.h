@@ -0,0 +1,27 @@
+/*
+ * Serial port over Telnet stream compression definitions
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ */
+
+#pragma once
+
+#include <zlib.h>
+
+/* MCCP2 compresses the data from the server, MCCP3 the data to it. */
+struct mccp {
+	z_stream in;
+	z_stream out;
+	int inflating;
+	int deflating;
+};
+
+int mccp_start_inflate (struct mccp *mccp);
+
+int mccp_start_deflate (struct mccp *mccp);
+
+int mccp_inflate (struct mccp *mccp, unsigned char *src, int *srcbytes, unsigned char *dst, int dstsize);
+
+int mccp_deflate (struct mccp *mccp, unsigned char *src, int *srcbytes, unsigned char *dst, int dstsize, int flush);
+
+void mccp_end (struct mccp *mccp);
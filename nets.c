@@ -4,184 +4,1880 @@
  * License: GPL
  */
 
-#define _POSIX_C_SOURCE 201112L
-#define _XOPEN_SOURCE
-#define _XOPEN_SOURCE_EXTENDED
+#define _GNU_SOURCE
 
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <pty.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
+#include "mccp.h"
 
-int
-main (int argc, char *argv[])
+/* How long to wait before reconnecting after connect failed. */
+#define RETRY_DELAY 1000
+
+#define MAX_SETTINGS 16
+#define MAX_ENDPOINTS 8
+
+/* Longest negotiation we start a connection with. */
+#define GREETING_MAX (3 + MAX_SETTINGS * RFC2217_PUT_MAX (0))
+
+/* The state of a connection to a telnet server. */
+struct link {
+	int endpoint;
+	/* Not connected yet. */
+	int connecting;
+	/* We've sent WILL COM-PORT-OPTION and the server didn't answer yet.
+	 * The pending count is the number of settings not yet acknowledged. */
+	int negotiating;
+	int pending;
+	/* The server agreed to COM-PORT-OPTION. */
+	int com_port;
+	/* The compression options offered while on standby, as bits. */
+	int offers;
+};
+
+/* The outbut buffer is twice as big because the IAC can be doubled.
+ * If only a half of an IAC IAC has been sent, the other one is at the
+ * start of the output buffer and has to go before any command does. */
+static unsigned char inbuf[512], outbuf[1024];
+static int inbytes = 0, outbytes = 0;
+static int out_split = 0;
+
+/* The commands for the telnet server. They're sent ahead of the data
+ * in the output buffer. When the compression is on, they go through the
+ * compressor, except for the ctl_raw bytes up to and including the
+ * one that turned the compression on. */
+static unsigned char ctlbuf[512];
+static int ctlbytes = 0;
+static int ctl_raw = 0;
+
+/* Where the commands queued end and when were they queued, to tell
+ * how long they waited. */
+static struct {
+	int end;
+	long long queued;
+} frames[32];
+static int nframes = 0;
+static long long ctl_sent = 0;
+static long long ctl_wait = 0;
+static long long ctl_wait_max = 0;
+
+/* How long the data from the server waited in the socket before
+ * they were read, in microseconds. */
+static long long rx_samples = 0;
+static long long rx_wait = 0;
+static long long rx_wait_min = -1;
+static long long rx_wait_max = 0;
+
+static volatile sig_atomic_t report_requested = 0;
+
+/* The server, the PTY, the standby server, the command, the PTY users. */
+static struct pollfd pfd[5];
+static pid_t pid = 0;
+
+/* Whether the command is watched with a signalfd rather than a pidfd
+ * and when is it going to be restarted. */
+static int child_signalfd = 0;
+static long long restart_at = -1;
+
+/* The master side of the PTY. Once nobody has the slave side open and
+ * what's been left there is read, the master is not watched, otherwise
+ * it would keep reporting POLLHUP. Instead, the opens of the slave are
+ * watched with inotify. Instead of the PTY there can be a listening
+ * UNIX socket, with one user at most. */
+static int pty_fd = -1;
+static enum {
+	PTY_OPEN,
+	PTY_CLOSED,
+	PTY_UNUSED,
+} pty_state = PTY_UNUSED;
+static int users = 0;
+static long long idle_at = -1;
+
+/* The connection in use and the one ready to take over. */
+static struct link active;
+static struct link standby;
+static unsigned char sinbuf[512];
+static int sinbytes = 0;
+static int standby_next = 0;
+static long long standby_retry_at = -1;
+
+/* The serial port settings last reported by the active server, 0 if
+ * unknown. The SET_CONTROL ones are indexed by the CONTROL_REQ_* code. */
+static int port[SET_STOPSIZE + 1];
+static int port_control[CONTROL_REQ_RESERVED];
+
+/* The PTY has been made available to its users. */
+static int published = 0;
+
+/* When to try to connect again, -1 if right away, and which endpoint
+ * to try first. */
+static long long retry_at = -1;
+static int active_next = 0;
+
+/* When was the last time anything was sent to or received from the
+ * telnet server and when the reply to our probe is due, -1 if not expected. */
+static long long active_at = -1;
+static long long reply_by = -1;
+
+/* Compressed data from the telnet server and the data to be compressed
+ * for it. The input one has extra room for the data that was read
+ * before the server turned the compression on. */
+static unsigned char zinbuf[1024], zoutbuf[1024];
+static int zinbytes = 0, zoutbytes = 0;
+static int zout_split = 0;
+static struct mccp mccp;
+static int compress_starting = 0;
+
+/* When the compressed output needs to be flushed, -1 if not pending. */
+static long long flush_at = -1;
+
+/* The estimate of how much of the data we've sent the serial port has
+ * not transmitted yet, in thousandths of a character, as of paced_at. */
+static long long in_flight = 0;
+static long long paced_at = 0;
+
+/* The data from the telnet server waiting for the line to go quiet so
+ * that they're passed to the PTY at once, and when that happens. */
+static unsigned char framebuf[512];
+static int framebytes = 0;
+static long long frame_at = -1;
+
+/* Settings. */
+static int compression = 0;
+static int flush_delay = 0;
+static int wait_ready = 0;
+static int ready_timeout = -1;
+static int notify_fd = -1;
+static int dead_timeout = -1;
+static int heartbeat = -1;
+static int heartbeat_signature = 0;
+static int pace_budget = -1;
+static int pace_baud = 0;
+static int frame_gap = -1;
+static int frame_max = sizeof (framebuf);
+static enum {
+	RESTART_NEVER,
+	RESTART_ON_FAILURE,
+	RESTART_ALWAYS,
+} restart_policy = RESTART_NEVER;
+static int idle_timeout = -1;
+static const char *unix_path = NULL;
+static int cpu = -1;
+static int rt_priority = -1;
+static int lock_memory = 0;
+static int busy_poll = 0;
+static cpu_set_t cpus;
+static int use_standby = 0;
+static struct {
+	enum com_port_option option;
+	int value;
+} settings[MAX_SETTINGS];
+static int nsettings = 0;
+static struct {
+	const char *host;
+	const char *service;
+} endpoints[MAX_ENDPOINTS];
+static int nendpoints = 1;
+
+static long long
+now_us (void)
 {
-	/* The outbut buffer is twice as big because the IAC can be doubled. */
-	unsigned char inbuf[512], outbuf[1024];
-	int inbytes = 0, outbytes = 0;
-	struct pollfd pfd[2];
-	pid_t pid = 0;
-	int status;
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static long long
+now (void)
+{
+	return now_us () / 1000;
+}
+
+/* Shorten the poll timeout so that we wake up at given time. */
+static void
+set_timeout (int *timeout, long long when)
+{
+	long long left;
+
+	if (when == -1)
+		return;
+
+	left = when - now ();
+	if (left < 0)
+		left = 0;
+	if (*timeout == -1 || left < *timeout)
+		*timeout = left;
+}
+
+static void promote (void);
+
+/* Cut off the command that the server has not finished sending, if any.
+ * Otherwise what the next one sends would be taken for its rest. */
+static void
+drop_partial_command (void)
+{
+	int i = 0;
 	int res;
+
+	while (i < inbytes) {
+		res = rfc2217_get_esc (&inbuf[i], inbytes - i, NULL, NULL, NULL);
+		if (res == 0) {
+			res = rfc2217_get_data (&inbuf[i], inbytes - i);
+			if (res == 1 && inbuf[i] == IAC && inbytes - i >= 2)
+				res = 2;
+		}
+		if (res == 0)
+			break;
+		i += res;
+	}
+	inbytes = i;
+}
+
+/* Close the connection to the telnet server. The data that has not been
+ * compressed yet can be sent over the next connection, the compressed
+ * ones are lost. If there's a standby connection, it takes over. */
+static void
+hangup (void)
+{
+	if (pfd[0].fd != -1)
+		close (pfd[0].fd);
+	pfd[0].fd = -1;
+	pfd[0].revents = 0;
+	active_next = active.endpoint + 1;
+	active.connecting = 0;
+	active.negotiating = 0;
+	active.pending = 0;
+	reply_by = -1;
+
+	/* A lone half of an IAC IAC would start a command. */
+	if (mccp.deflating) {
+		memcpy (outbuf, &zoutbuf[zout_split], zoutbytes - zout_split);
+		outbytes = zoutbytes - zout_split;
+		zoutbytes = 0;
+	} else if (out_split) {
+		outbytes--;
+		memmove (outbuf, &outbuf[1], outbytes);
+	}
+	out_split = 0;
+	zout_split = 0;
+
+	/* The commands were meant for this connection. */
+	ctlbytes = 0;
+	ctl_raw = 0;
+	nframes = 0;
+
+	mccp_end (&mccp);
+	zinbytes = 0;
+	compress_starting = 0;
+	flush_at = -1;
+	drop_partial_command ();
+
+	if (pfd[2].fd != -1 && !standby.connecting && !standby.negotiating && !standby.pending)
+		promote ();
+}
+
+/* Characters per second the serial port transmits, 0 if not known. */
+static int
+char_rate (void)
+{
+	int baud = port[SET_BAUDRATE] ? port[SET_BAUDRATE] : pace_baud;
+	int bits;
+
+	/* The start bit, the data bits and the parity bit. */
+	bits = 1 + (port[SET_DATASIZE] ? port[SET_DATASIZE] : 8);
+	if (port[SET_PARITY] > 1)
+		bits++;
+
+	/* 1.5 stop bits (3) are counted as two. */
+	bits += port[SET_STOPSIZE] > 1 ? 2 : 1;
+
+	return baud / bits;
+}
+
+/* How many characters can we send to the server without having more than
+ * pace_budget milliseconds of them waiting for the serial port. The rest
+ * is left in the PTY, where it can still be flushed. Returns -1 if there's
+ * no limit, otherwise sets the time when there's room again. */
+static int
+pace_room (long long *pace_at)
+{
+	long long t = now ();
+	long long limit;
+	int rate = char_rate ();
+
+	if (pace_budget == -1 || rate == 0)
+		return -1;
+
+	in_flight -= (t - paced_at) * rate;
+	if (in_flight < 0)
+		in_flight = 0;
+	paced_at = t;
+
+	/* Always allow at least one character. */
+	limit = (long long)pace_budget * rate;
+	if (limit < 1000)
+		limit = 1000;
+
+	if (limit - in_flight >= 1000)
+		return (limit - in_flight) / 1000;
+
+	*pace_at = t + (in_flight - limit + 1000 + rate - 1) / rate;
+	return 0;
+}
+
+/* Move the data from the start of the input buffer to the frame that's
+ * being collected, undoubling the IACs. Returns the number of bytes
+ * moved. */
+static int
+collect_frame (void)
+{
+	int rate = char_rate ();
+	int moved = 0;
+	int res;
+
+	while (inbytes && framebytes < frame_max) {
+		if (inbuf[0] == IAC) {
+			/* Either an IAC IAC, or a command. */
+			if (inbytes < 2 || inbuf[1] != IAC)
+				break;
+			framebuf[framebytes++] = IAC;
+			res = 2;
+		} else {
+			res = get_data (inbuf, inbytes);
+			if (res > frame_max - framebytes)
+				res = frame_max - framebytes;
+			memcpy (&framebuf[framebytes], inbuf, res);
+			framebytes += res;
+		}
+		inbytes -= res;
+		memmove (inbuf, &inbuf[res], inbytes);
+		moved += res;
+	}
+
+	/* The frame ends when nothing comes for frame_gap thousandths of a
+	 * character. */
+	if (moved) {
+		frame_at = now ();
+		if (rate)
+			frame_at += (frame_gap + rate - 1) / rate;
+	}
+
+	return moved;
+}
+
+/* Room for the data that are to be sent to the telnet server. */
+static int
+tx_room (void)
+{
+	if (mccp.deflating)
+		return sizeof (zoutbuf) - zoutbytes;
+	return sizeof (outbuf) - outbytes;
+}
+
+/* Queue the data for the telnet server, doubling the IACs. The caller
+ * makes sure there's room for that. */
+static void
+transmit (const unsigned char *buf, int size)
+{
+	unsigned char *dst = mccp.deflating ? zoutbuf : outbuf;
+	int *bytes = mccp.deflating ? &zoutbytes : &outbytes;
 	int i;
 
-	if (argc < 3) {
-		fprintf (stderr, "Usage: %s <host> <port> [<link>|--] <command> ...]\n", argv[0]);
-		return 2;
+	for (i = 0; i < size; i++) {
+		dst[(*bytes)++] = buf[i];
+		if (buf[i] == IAC)
+			dst[(*bytes)++] = IAC;
 	}
 
-	pfd[0].fd = -1; /* Will be (re)opened on demand. */
+	if (mccp.deflating && flush_at == -1)
+		flush_at = now () + flush_delay;
+}
 
-	pfd[1].fd = open ("/dev/ptmx", O_RDWR);
-	if (pfd[1].fd == -1) {
-		perror ("ptmx");
+/* Queue a command for the telnet server. */
+static int
+queue_command (const unsigned char *buf, int size)
+{
+	if (size > sizeof (ctlbuf) - ctlbytes) {
+		fprintf (stderr, "Command buffer full, dropping %d bytes\n", size);
+		return -1;
+	}
+
+	memcpy (&ctlbuf[ctlbytes], buf, size);
+	ctlbytes += size;
+
+	if (nframes < sizeof (frames) / sizeof (frames[0])) {
+		frames[nframes].end = ctlbytes;
+		frames[nframes].queued = now_us ();
+		nframes++;
+	}
+
+	return 0;
+}
+
+/* Account for the commands that are sent (or compressed), that is,
+ * removed from the command buffer between given offsets. */
+static void
+ctl_done (int start, int end)
+{
+	long long wait;
+	int i, j;
+
+	for (i = 0, j = 0; i < nframes; i++) {
+		if (frames[i].end > end) {
+			frames[i].end -= end - start;
+		} else if (frames[i].end > start) {
+			wait = now_us () - frames[i].queued;
+			ctl_sent++;
+			ctl_wait += wait;
+			if (wait > ctl_wait_max)
+				ctl_wait_max = wait;
+			continue;
+		}
+		frames[j++] = frames[i];
+	}
+	nframes = j;
+}
+
+/* The commands that can be sent as they are. */
+static int
+ctl_ready (void)
+{
+	return mccp.deflating ? ctl_raw : ctlbytes;
+}
+
+/* After some of the escaped data has been consumed, tell if what's left
+ * starts with the second half of an IAC IAC. The IACs always come in
+ * pairs, so that's if it starts with an odd number of them. */
+static int
+split_iac (const unsigned char *buf, int size)
+{
+	int i;
+
+	for (i = 0; i < size && buf[i] == IAC; i++)
+		;
+
+	return i % 2;
+}
+
+/* Everything the server gets after the subnegotiation that is
+ * queued now is compressed, including the data still queued. */
+static void
+start_deflate (void)
+{
+	if (mccp_start_deflate (&mccp) == -1)
+		return;
+
+	ctl_raw = ctlbytes;
+	memcpy (zoutbuf, &outbuf[out_split], outbytes - out_split);
+	zoutbytes = outbytes - out_split;
+	outbytes = out_split;
+}
+
+/* Compress the queued commands and data into the output buffer, flushing
+ * the compressor if the data have been waiting for long enough or there
+ * is a command. */
+static void
+deflate_output (void)
+{
+	int flush;
+	int before;
+	int res;
+	int n;
+
+	/* Complete the IAC IAC, so that the commands don't end up in
+	 * between. */
+	if (zout_split) {
+		n = 1;
+		res = mccp_deflate (&mccp, zoutbuf, &n,
+			&outbuf[outbytes], sizeof (outbuf) - outbytes, Z_NO_FLUSH);
+		if (res == -1) {
+			hangup ();
+			return;
+		}
+		outbytes += res;
+		if (n)
+			return;
+		zoutbytes--;
+		memmove (zoutbuf, &zoutbuf[1], zoutbytes);
+		zout_split = 0;
+	}
+
+	if (ctlbytes > ctl_raw) {
+		n = before = ctlbytes - ctl_raw;
+		res = mccp_deflate (&mccp, &ctlbuf[ctl_raw], &n,
+			&outbuf[outbytes], sizeof (outbuf) - outbytes, Z_NO_FLUSH);
+		if (res == -1) {
+			hangup ();
+			return;
+		}
+		outbytes += res;
+		ctl_done (ctl_raw, ctl_raw + before - n);
+		ctlbytes -= before - n;
+		if (n)
+			return;
+		flush_at = now ();
+	}
+
+	flush = flush_at != -1 && now () >= flush_at;
+	before = zoutbytes;
+	res = mccp_deflate (&mccp, zoutbuf, &zoutbytes,
+		&outbuf[outbytes], sizeof (outbuf) - outbytes,
+		flush ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+	if (res == -1) {
+		hangup ();
+		return;
+	}
+	outbytes += res;
+	if (zoutbytes != before)
+		zout_split = split_iac (zoutbuf, zoutbytes);
+
+	if (flush && zoutbytes == 0 && outbytes < sizeof (outbuf))
+		flush_at = -1;
+}
+
+/* Send what's possible, the commands ahead of the data, unless they'd
+ * end up in the middle of an IAC IAC. */
+static int
+send_output (void)
+{
+	struct iovec iov[3];
+	int ctl = ctl_ready ();
+	int res;
+	int n;
+
+	iov[0].iov_base = outbuf;
+	iov[0].iov_len = out_split;
+	iov[1].iov_base = ctlbuf;
+	iov[1].iov_len = ctl;
+	iov[2].iov_base = &outbuf[out_split];
+	iov[2].iov_len = outbytes - out_split;
+
+	res = writev (pfd[0].fd, iov, 3);
+	if (res <= 0)
+		return res;
+
+	n = res;
+	if (out_split) {
+		outbytes--;
+		memmove (outbuf, &outbuf[1], outbytes);
+		out_split = 0;
+		n--;
+	}
+
+	if (ctl) {
+		if (n < ctl)
+			ctl = n;
+		ctlbytes -= ctl;
+		memmove (ctlbuf, &ctlbuf[ctl], ctlbytes);
+		if (ctl_raw)
+			ctl_raw -= ctl;
+		ctl_done (0, ctl);
+		n -= ctl;
+	}
+
+	if (n) {
+		outbytes -= n;
+		memmove (outbuf, &outbuf[n], outbytes);
+		if (!mccp.deflating)
+			out_split = split_iac (outbuf, outbytes);
+	}
+
+	return res;
+}
+
+/* Whether any of the options for low latency have been given. */
+static int
+low_latency (void)
+{
+	return cpu != -1 || rt_priority != -1 || lock_memory || busy_poll;
+}
+
+static void
+report (void)
+{
+	fprintf (stderr, "Commands: %lld sent, waited %lld us on average, %lld us at most\n",
+		ctl_sent, ctl_sent ? ctl_wait / ctl_sent : 0, ctl_wait_max);
+	if (low_latency ())
+		fprintf (stderr, "Received: %lld times, waited %lld us on average, %lld-%lld us\n",
+			rx_samples, rx_samples ? rx_wait / rx_samples : 0,
+			rx_wait_min == -1 ? 0 : rx_wait_min, rx_wait_max);
+}
+
+/* Have the kernel tell when the data from the server arrived, to show
+ * the effect of the low latency options. */
+static void
+timestamp_input (int fd)
+{
+	int on = 1;
+
+	if (!low_latency ())
+		return;
+
+	setsockopt (fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof (on));
+}
+
+/* Read from the server, noting how long the data have been waiting. */
+static int
+receive (unsigned char *buf, int size)
+{
+	union {
+		char buf[CMSG_SPACE (sizeof (struct timespec))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = { .iov_base = buf, .iov_len = size };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof (control.buf),
+	};
+	struct cmsghdr *cmsg;
+	struct timespec arrived, ts;
+	long long wait;
+	int res;
+
+	if (!low_latency ())
+		return read (pfd[0].fd, buf, size);
+
+	res = recvmsg (pfd[0].fd, &msg, 0);
+	if (res <= 0)
+		return res;
+
+	for (cmsg = CMSG_FIRSTHDR (&msg); cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS)
+			continue;
+		memcpy (&arrived, CMSG_DATA (cmsg), sizeof (arrived));
+		clock_gettime (CLOCK_REALTIME, &ts);
+		wait = (ts.tv_sec - arrived.tv_sec) * 1000000LL
+			+ (ts.tv_nsec - arrived.tv_nsec) / 1000;
+		rx_samples++;
+		rx_wait += wait;
+		if (rx_wait_min == -1 || wait < rx_wait_min)
+			rx_wait_min = wait;
+		if (wait > rx_wait_max)
+			rx_wait_max = wait;
+	}
+
+	return res;
+}
+
+/* Wait for the events. Unless it's time to do something else, keep
+ * checking for them for busy_poll microseconds first, instead of going
+ * to sleep and waiting for the scheduler to wake us up. */
+static int
+wait_events (int nfds, int timeout)
+{
+	long long start;
+	long long spin;
+	int res;
+
+	if (busy_poll == 0 || timeout == 0)
+		return poll (pfd, nfds, timeout);
+
+	start = now_us ();
+	spin = busy_poll;
+	if (timeout != -1 && timeout * 1000LL < spin)
+		spin = timeout * 1000LL;
+
+	do {
+		res = poll (pfd, nfds, 0);
+		if (res != 0)
+			return res;
+	} while (now_us () - start < spin);
+
+	if (timeout != -1) {
+		timeout -= (now_us () - start) / 1000;
+		if (timeout < 0)
+			timeout = 0;
+	}
+	return poll (pfd, nfds, timeout);
+}
+
+/* Make the scheduling latency of the main loop low and predictable. */
+static int
+realtime (void)
+{
+	struct sched_param param = { .sched_priority = rt_priority };
+	cpu_set_t set;
+
+	if (cpu != -1) {
+		sched_getaffinity (0, sizeof (cpus), &cpus);
+		CPU_ZERO (&set);
+		CPU_SET (cpu, &set);
+		if (sched_setaffinity (0, sizeof (set), &set) == -1) {
+			perror ("sched_setaffinity");
+			return -1;
+		}
+	}
+
+	/* The command runs with the normal priority. */
+	if (rt_priority != -1) {
+		if (sched_setscheduler (0, SCHED_FIFO | SCHED_RESET_ON_FORK, &param) == -1) {
+			perror ("sched_setscheduler");
+			return -1;
+		}
+	}
+
+	if (lock_memory) {
+		if (mlockall (MCL_CURRENT | MCL_FUTURE) == -1) {
+			perror ("mlockall");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+request_report (int sig)
+{
+	report_requested = 1;
+}
+
+static void
+got_option (void *data, enum com_port_option option, union com_port_option_value *value)
+{
+	struct link *link = data;
+
+	/* The server acknowledges the settings by sending them back. */
+	if (option >= SET_BAUDRATE && option <= SET_CONTROL && link->pending)
+		link->pending--;
+
+	if (link != &active)
+		return;
+
+	/* The reply to the probe. */
+	if (option == SIGNATURE)
+		reply_by = -1;
+
+	/* Remember them in case another server takes over. */
+	switch (option) {
+	case SET_BAUDRATE:
+		port[option] = value->baudrate;
+		break;
+	case SET_DATASIZE:
+		port[option] = value->datasize;
+		break;
+	case SET_PARITY:
+		port[option] = value->parity;
+		break;
+	case SET_STOPSIZE:
+		port[option] = value->stopsize;
+		break;
+	case SET_CONTROL:
+		if (control_to_req (value->control) != CONTROL_REQ_RESERVED)
+			port_control[control_to_req (value->control)] = value->control;
+		break;
+	default:
+		break;
+	}
+}
+
+static void
+negotiate (void *data, int command, int option)
+{
+	unsigned char reply[] = { IAC, DO, option, IAC, SB, option, IAC, SE };
+	struct link *link = data;
+
+	if (option == COM_PORT_OPTION) {
+		link->com_port = command == DO || command == WILL;
+		if (link->negotiating) {
+			link->negotiating = 0;
+			if (!link->com_port) {
+				fprintf (stderr, "The server refused COM-PORT-OPTION\n");
+				link->pending = 0;
+			}
+		}
+		return;
+	}
+
+	if (!compression)
+		return;
+
+	if (link != &active) {
+		/* Taken up once the link becomes active. */
+		if (command == WILL && (option == COMPRESS2 || option == COMPRESS3))
+			link->offers |= 1 << (option - COMPRESS2);
+		return;
+	}
+
+	switch (command) {
+	case WILL:
+		if (option == COMPRESS2 && !mccp.inflating) {
+			queue_command (reply, 3);
+		} else if (option == COMPRESS3 && !mccp.deflating) {
+			/* Everything after the subnegotiation is compressed. */
+			if (queue_command (reply, sizeof (reply)) == 0)
+				start_deflate ();
+		}
+		break;
+	case SB:
+		if (option == COMPRESS2 && !mccp.inflating)
+			compress_starting = 1;
+		break;
+	}
+}
+
+/* Decompress the data from the telnet server and process the commands
+ * at the start of the input buffer. */
+static void
+process_input (void)
+{
+	int res;
+
+	while (1) {
+		if (mccp.inflating) {
+			res = mccp_inflate (&mccp, zinbuf, &zinbytes,
+				&inbuf[inbytes], sizeof (inbuf) - inbytes);
+			if (res == -1) {
+				hangup ();
+				return;
+			}
+			inbytes += res;
+		}
+
+		if (!mccp.inflating && zinbytes) {
+			/* What follows the end of compressed stream is plain. */
+			res = sizeof (inbuf) - inbytes;
+			if (res > zinbytes)
+				res = zinbytes;
+			memcpy (&inbuf[inbytes], zinbuf, res);
+			inbytes += res;
+			zinbytes -= res;
+			memmove (zinbuf, &zinbuf[res], zinbytes);
+		}
+
+		/* Process the data from the telnet server.
+		 * If just one character was consumed, then the other IAC has
+		 * to be left verbatim. */
+		while ((res = rfc2217_get_esc (inbuf, inbytes, got_option, negotiate, &active)) > 1) {
+			inbytes -= res;
+			memmove (inbuf, &inbuf[res], inbytes);
+			if (compress_starting)
+				break;
+		};
+
+		if (!compress_starting)
+			return;
+
+		/* Whatever follows has to be decompressed. */
+		compress_starting = 0;
+		memmove (&zinbuf[inbytes], zinbuf, zinbytes);
+		memcpy (zinbuf, inbuf, inbytes);
+		zinbytes += inbytes;
+		inbytes = 0;
+		if (mccp_start_inflate (&mccp) == -1) {
+			hangup ();
+			return;
+		}
+	}
+}
+
+/* How long to wait for the server to reply to the probe. */
+static int
+reply_wait (void)
+{
+	return dead_timeout == -1 ? heartbeat : dead_timeout;
+}
+
+/* Send a NOP if the connection to the telnet server has been idle for
+ * too long. If it's dead, sending fails in dead_timeout. Alternatively,
+ * ask for the signature, which the server has to reply to with a
+ * command, within the same time. Unlike the reply to an AYT it doesn't
+ * end up among the serial port data. A server that hasn't agreed to
+ * COM-PORT-OPTION wouldn't reply, so it only gets the NOP. */
+static void
+probe (void)
+{
+	union com_port_option_value value = { .signature = { .size = 0 } };
+	unsigned char cmd[RFC2217_PUT_MAX (0)] = { IAC, NOP };
+	int signature = heartbeat_signature && active.com_port;
+	int size = 2;
+
+	if (heartbeat == -1 || reply_by != -1 || now () < active_at + heartbeat)
+		return;
+
+	if (signature)
+		size = rfc2217_put (cmd, SIGNATURE, &value);
+	if (queue_command (cmd, size) == -1)
+		return;
+	active_at = now ();
+	if (signature)
+		reply_by = active_at + reply_wait ();
+}
+
+/* The negotiation we start each connection with, if any. */
+static int
+greeting (unsigned char *buf)
+{
+	int size = 0;
+	int i;
+
+	if (!wait_ready && nsettings == 0 && !heartbeat_signature)
+		return 0;
+
+	size += rfc2217_put_command (&buf[size], WILL, COM_PORT_OPTION);
+	for (i = 0; i < nsettings; i++)
+		size += put_com_port_option (&buf[size], settings[i].option, settings[i].value);
+
+	return size;
+}
+
+/* Start connecting to the first telnet server that can be tried, going
+ * on from the one that failed last. The socket becomes writable once it's
+ * known whether it worked out. */
+static int
+connect_active (void)
+{
+	int fd;
+	int i;
+
+	for (i = 0; i < nendpoints; i++) {
+		active_next %= nendpoints;
+		fd = start_socket (endpoints[active_next].host, endpoints[active_next].service);
+		if (fd != -1) {
+			memset (&active, 0, sizeof (active));
+			active.endpoint = active_next;
+			active.connecting = 1;
+			return fd;
+		}
+		active_next++;
+	}
+
+	return -1;
+}
+
+/* Start the negotiation on a fresh connection to the telnet server. */
+static void
+connected (void)
+{
+	unsigned char buf[GREETING_MAX];
+	int size;
+
+	active_at = now ();
+	timestamp_input (pfd[0].fd);
+	if (dead_timeout != -1)
+		set_keepalive (pfd[0].fd, dead_timeout);
+
+	size = greeting (buf);
+	if (size == 0)
+		return;
+
+	queue_command (buf, size);
+	active.negotiating = 1;
+	active.pending = nsettings;
+}
+
+static void
+standby_hangup (void)
+{
+	close (pfd[2].fd);
+	pfd[2].fd = -1;
+	standby_next = standby.endpoint + 1;
+	standby_retry_at = now () + RETRY_DELAY;
+}
+
+/* Start connecting to the next endpoint, so that it is ready to take
+ * over when the active one fails. */
+static void
+standby_connect (void)
+{
+	int i;
+
+	if (standby_retry_at != -1 && now () < standby_retry_at)
+		return;
+
+	for (i = 0; i < nendpoints; i++) {
+		standby_next %= nendpoints;
+		if (standby_next != active.endpoint)
+			break;
+		standby_next++;
+	}
+	if (i == nendpoints)
+		return;
+
+	memset (&standby, 0, sizeof (standby));
+	standby.endpoint = standby_next;
+	sinbytes = 0;
+
+	pfd[2].fd = start_socket (endpoints[standby.endpoint].host, endpoints[standby.endpoint].service);
+	if (pfd[2].fd == -1) {
+		standby_next++;
+		standby_retry_at = now () + RETRY_DELAY;
+		return;
+	}
+	standby.connecting = 1;
+	standby_retry_at = -1;
+}
+
+/* Negotiate on the standby connection and discard the data. */
+static void
+standby_event (void)
+{
+	unsigned char buf[GREETING_MAX];
+	int size;
+	int res;
+
+	if (standby.connecting) {
+		if (finish_socket (pfd[2].fd) == -1) {
+			standby_hangup ();
+			return;
+		}
+		standby.connecting = 0;
+		if (dead_timeout != -1)
+			set_keepalive (pfd[2].fd, dead_timeout);
+
+		size = greeting (buf);
+		if (size && write (pfd[2].fd, buf, size) != size) {
+			perror ("write");
+			standby_hangup ();
+			return;
+		}
+		standby.negotiating = size != 0;
+		standby.pending = size ? nsettings : 0;
+		return;
+	}
+
+	if (!(pfd[2].revents & POLLIN)) {
+		standby_hangup ();
+		return;
+	}
+
+	res = read (pfd[2].fd, &sinbuf[sinbytes], sizeof (sinbuf) - sinbytes);
+	if (res <= 0) {
+		if (res == -1)
+			perror ("read");
+		standby_hangup ();
+		return;
+	}
+	sinbytes += res;
+
+	while (sinbytes) {
+		res = rfc2217_get_esc (sinbuf, sinbytes, got_option, negotiate, &standby);
+		if (res == 0) {
+			res = rfc2217_get_data (sinbuf, sinbytes);
+			if (res == 1 && sinbuf[0] == IAC && sinbytes >= 2)
+				res = 2;
+		}
+		if (res == 0)
+			break;
+		sinbytes -= res;
+		memmove (sinbuf, &sinbuf[res], sinbytes);
+	}
+}
+
+/* Make the standby connection the active one, restoring the serial port
+ * settings and the compression. */
+static void
+promote (void)
+{
+	unsigned char buf[RFC2217_PUT_MAX (0)];
+	int offers = standby.offers;
+	int i;
+
+	fprintf (stderr, "Switching to %s:%s\n",
+		endpoints[standby.endpoint].host, endpoints[standby.endpoint].service);
+
+	pfd[0].fd = pfd[2].fd;
+	pfd[2].fd = -1;
+	timestamp_input (pfd[0].fd);
+	active = standby;
+	active.offers = 0;
+	active_at = now ();
+	sinbytes = 0;
+	standby_next = 0;
+	standby_retry_at = -1;
+
+	for (i = SET_BAUDRATE; i <= SET_STOPSIZE; i++) {
+		if (port[i])
+			queue_command (buf, put_com_port_option (buf, i, port[i]));
+	}
+	for (i = 0; i < CONTROL_REQ_RESERVED; i++) {
+		if (port_control[i])
+			queue_command (buf, put_com_port_option (buf, SET_CONTROL, port_control[i]));
+	}
+
+	for (i = COMPRESS2; i <= COMPRESS3; i++) {
+		if (offers & (1 << (i - COMPRESS2)))
+			negotiate (&active, WILL, i);
+	}
+}
+
+/* Tell whoever is waiting for us that the PTY is usable. The notify
+ * file descriptor gets the PTY name, the sd_notify(3) socket gets
+ * the READY=1 message. */
+static void
+notify_ready (const char *pty)
+{
+	struct sockaddr_un sun;
+	const char *path;
+	char msg[128];
+	int addrlen;
+	int len;
+	int fd;
+
+	if (notify_fd != -1) {
+		dprintf (notify_fd, "%s\n", pty);
+		close (notify_fd);
+		notify_fd = -1;
+	}
+
+	path = getenv ("NOTIFY_SOCKET");
+	if (path == NULL || path[0] == '\0')
+		return;
+	addrlen = unix_address (path, &sun);
+	if (addrlen == -1)
+		return;
+
+	fd = socket (AF_UNIX, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		perror ("socket");
+		return;
+	}
+
+	len = snprintf (msg, sizeof (msg), "READY=1\nSTATUS=%s\n", pty);
+	if (sendto (fd, msg, len, 0, (struct sockaddr *)&sun, addrlen) == -1) {
+		perror (path);
+	}
+	close (fd);
+}
+
+/* Where the users get the data, the PTY or the UNIX socket. */
+static const char *
+device_name (void)
+{
+	return unix_path ? unix_path : ptsname (pty_fd);
+}
+
+/* Watch for the command to terminate. A pidfd is used if the kernel
+ * supports it, otherwise a signalfd for SIGCHLD that stays open for
+ * the restarted commands too. SIGCHLD is blocked before the fork, so
+ * that it's not lost before the signalfd exists. */
+static int
+watch_child (void)
+{
+	sigset_t mask;
+
+	if (child_signalfd)
+		return 0;
+
+#ifdef SYS_pidfd_open
+	pfd[3].fd = syscall (SYS_pidfd_open, pid, 0);
+	if (pfd[3].fd != -1)
+		return 0;
+#endif
+
+	sigemptyset (&mask);
+	sigaddset (&mask, SIGCHLD);
+	pfd[3].fd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (pfd[3].fd == -1) {
+		perror ("signalfd");
+		return -1;
+	}
+	child_signalfd = 1;
+	return 0;
+}
+
+/* Run the command. */
+static int
+spawn (int argc, char *argv[])
+{
+	char *args[argc];
+	sigset_t mask, oldmask;
+	int i;
+
+	sigemptyset (&mask);
+	sigaddset (&mask, SIGCHLD);
+	sigprocmask (SIG_BLOCK, &mask, &oldmask);
+
+	pid = fork ();
+	if (pid == -1) {
+		perror ("fork");
+		return -1;
+	}
+
+	if (pid == 0) {
+		sigprocmask (SIG_SETMASK, &oldmask, NULL);
+		if (cpu != -1)
+			sched_setaffinity (0, sizeof (cpus), &cpus);
+		for (i = 4; i < argc; i++) {
+			if (strcmp (argv[i], "{}"))
+				args[i - 4] = argv[i];
+			else
+				args[i - 4] = (char *)device_name ();
+		}
+		args[i - 4] = NULL;
+
+		execvp (args[0], args);
+		perror (args[0]);
+		exit (-1);
+	}
+
+	return watch_child ();
+}
+
+/* The command may have terminated. Returns its exit status if we're
+ * done, -1 otherwise. */
+static int
+child_event (void)
+{
+	struct signalfd_siginfo si;
+	int status;
+	int res;
+
+	if (child_signalfd) {
+		while (read (pfd[3].fd, &si, sizeof (si)) == sizeof (si))
+			;
+	}
+
+	res = waitpid (pid, &status, WNOHANG);
+	if (res == -1) {
+		perror ("waitpid");
 		return 1;
 	}
-	grantpt (pfd[1].fd);
-	unlockpt (pfd[1].fd);
+	if (res == 0)
+		return -1;
+
+	pid = 0;
+	if (!child_signalfd) {
+		close (pfd[3].fd);
+		pfd[3].fd = -1;
+	}
+
+	if (restart_policy == RESTART_ALWAYS ||
+	    (restart_policy == RESTART_ON_FAILURE && !(WIFEXITED (status) && WEXITSTATUS (status) == 0))) {
+		restart_at = now () + RETRY_DELAY;
+		return -1;
+	}
+
+	return WIFEXITED (status) ? WEXITSTATUS (status) : 1;
+}
+
+/* Create the PTY and start watching for it to be opened. It's made
+ * raw, much like a serial port, and stays that way even when nobody has
+ * it open. */
+static int
+open_pty (void)
+{
+	struct termios tio;
+	int fd;
+
+	pty_fd = open ("/dev/ptmx", O_RDWR);
+	if (pty_fd == -1) {
+		perror ("ptmx");
+		return -1;
+	}
+	grantpt (pty_fd);
+	unlockpt (pty_fd);
+
+	fd = open (ptsname (pty_fd), O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (fd == -1) {
+		perror (ptsname (pty_fd));
+		return -1;
+	}
+	tcgetattr (fd, &tio);
+	cfmakeraw (&tio);
+	tcsetattr (fd, TCSANOW, &tio);
+	close (fd);
+
+	pfd[4].fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+	if (pfd[4].fd == -1) {
+		perror ("inotify_init1");
+		return -1;
+	}
+	if (inotify_add_watch (pfd[4].fd, ptsname (pty_fd), IN_OPEN) == -1) {
+		perror (ptsname (pty_fd));
+		return -1;
+	}
+
+	/* Nobody has it open yet. */
+	pfd[1].fd = -1;
+	return 0;
+}
+
+/* The master hung up, nobody has the PTY open anymore. */
+static void
+pty_hangup (void)
+{
+	/* Read what's left there, then stop watching it. */
+	if (pty_state == PTY_OPEN) {
+		pty_state = PTY_CLOSED;
+		users = 0;
+		if (idle_timeout != -1)
+			idle_at = now () + idle_timeout;
+	}
+	if (pfd[1].events & POLLIN && !(pfd[1].revents & POLLIN))
+		pty_state = PTY_UNUSED;
+}
+
+/* Someone opened the PTY. The events only tell us to look, they may be
+ * merged. Whether the PTY is in use is told by the master hanging up. */
+static void
+users_event (void)
+{
+	struct pollfd master = { .fd = pty_fd };
+	char buf[sizeof (struct inotify_event) * 16]
+		__attribute__ ((aligned (__alignof__ (struct inotify_event))));
+
+	while (read (pfd[4].fd, buf, sizeof (buf)) > 0)
+		;
+
+	if (poll (&master, 1, 0) == 1 && master.revents & POLLHUP)
+		return;
+
+	pty_state = PTY_OPEN;
+	users = 1;
+	idle_at = -1;
+}
+
+/* Start listening for the users of the UNIX socket. The data are
+ * passed through it as they are, without a line discipline. */
+static int
+listen_unix (void)
+{
+	struct sockaddr_un sun;
+	int len;
+
+	len = unix_address (unix_path, &sun);
+	if (len == -1) {
+		fprintf (stderr, "%s: Path too long\n", unix_path);
+		return -1;
+	}
+	if (unix_path[0] != '@')
+		unlink (unix_path);
+
+	pfd[4].fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (pfd[4].fd == -1) {
+		perror ("socket");
+		return -1;
+	}
+	if (bind (pfd[4].fd, (struct sockaddr *)&sun, len) == -1
+	    || listen (pfd[4].fd, 1) == -1) {
+		perror (unix_path);
+		return -1;
+	}
+
+	/* A user going away is not a reason to terminate. */
+	signal (SIGPIPE, SIG_IGN);
+	return 0;
+}
+
+/* A user connected to the UNIX socket. Another one is turned away. */
+static void
+accept_user (void)
+{
+	int fd;
+
+	fd = accept4 (pfd[4].fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1) {
+		perror ("accept");
+		return;
+	}
+	if (pfd[1].fd != -1) {
+		close (fd);
+		return;
+	}
+
+	pfd[1].fd = fd;
+	users = 1;
+	idle_at = -1;
+}
+
+/* The user of the UNIX socket went away. The data that it didn't get
+ * stay for the next one. */
+static void
+drop_user (void)
+{
+	close (pfd[1].fd);
+	pfd[1].fd = -1;
+	pfd[1].revents = 0;
+	users = 0;
+	if (idle_timeout != -1)
+		idle_at = now () + idle_timeout;
+}
+
+/* Whether there's any reason to be connected to the server. */
+static int
+wanted (void)
+{
+	return idle_timeout == -1 || !published || users || idle_at != -1;
+}
+
+/* Create the link and run the command. */
+static int
+publish (int argc, char *argv[])
+{
+	int res;
 
 	if (argc > 3) {
 		if (strcmp (argv[3], "--") != 0) {
 			/* We're making a link. */
 			unlink (argv[3]);
-			res = symlink (ptsname (pfd[1].fd), argv[3]);
+			res = symlink (device_name (), argv[3]);
 			if (res == -1) {
 				perror (argv[3]);
-				return 1;
+				return -1;
 			}
 		}
 		if (argc > 4) {
 			/* We're running a command. */
-			char *args[argc];
+			if (spawn (argc, argv) == -1)
+				return -1;
+		}
+	} else {
+		/* Just print the PTY name. */
+		printf ("%s\n", device_name ());
+		fflush (stdout);
+	}
 
-			pid = fork ();
-			if (pid == -1) {
-				perror ("fork");
-				return 1;
-			}
+	published = 1;
+	notify_ready (device_name ());
 
-			if (pid == 0) {
-				for (i = 4; i < argc; i++) {
-					if (strcmp (argv[i], "{}"))
-						args[i - 4] = argv[i];
-					else
-						args[i - 4] = ptsname (pfd[1].fd);
-				}
-				args[i - 4] = NULL;
+	/* If we've connected before the PTY was published, disconnect
+	 * unless someone starts using it. */
+	if (idle_timeout != -1 && pfd[0].fd != -1 && users == 0)
+		idle_at = now () + idle_timeout;
+	return 0;
+}
 
-				res = execvp (args[0], args);
-				perror (args[0]);
-				return -1;
+int
+main (int argc, char *argv[])
+{
+	char *prog = argv[0];
+	long long ready_at = -1;
+	long long pace_at = -1;
+	struct sigaction sa;
+	int room;
+	char *value;
+	int timeout;
+	int res;
+
+	while ((res = getopt (argc, argv, "+zZ:s:wt:n:T:H:ae:Sp:b:g:m:r:i:U:C:F:MB:")) != -1) {
+		switch (res) {
+		case 'z':
+			compression = 1;
+			break;
+		case 'Z':
+			flush_delay = atoi (optarg);
+			break;
+		case 's':
+			if (nsettings == sizeof (settings) / sizeof (settings[0])) {
+				fprintf (stderr, "Too many settings\n");
+				return 2;
+			}
+			value = strchr (optarg, '=');
+			if (value == NULL) {
+				fprintf (stderr, "Bad setting: '%s'. Expected <setting>=<value>.\n", optarg);
+				return 2;
+			}
+			*value++ = '\0';
+			if (parse_setting (optarg, value, &settings[nsettings].option, &settings[nsettings].value) == -1)
+				return 2;
+			nsettings++;
+			break;
+		case 'w':
+			wait_ready = 1;
+			break;
+		case 't':
+			ready_timeout = atoi (optarg);
+			break;
+		case 'n':
+			notify_fd = atoi (optarg);
+			break;
+		case 'T':
+			dead_timeout = atoi (optarg);
+			break;
+		case 'H':
+			heartbeat = atoi (optarg);
+			break;
+		case 'a':
+			heartbeat_signature = 1;
+			break;
+		case 'e':
+			if (nendpoints == MAX_ENDPOINTS) {
+				fprintf (stderr, "Too many endpoints\n");
+				return 2;
+			}
+			if (strncmp (optarg, "unix:", 5) == 0) {
+				/* No port for a UNIX socket. */
+				endpoints[nendpoints].host = optarg;
+				endpoints[nendpoints].service = "-";
+				nendpoints++;
+				break;
+			}
+			value = strrchr (optarg, ':');
+			if (value == NULL) {
+				fprintf (stderr, "Bad endpoint: '%s'. Expected <host>:<port>.\n", optarg);
+				return 2;
+			}
+			*value++ = '\0';
+			if (optarg[0] == '[' && value[-2] == ']') {
+				/* An IPv6 address. */
+				value[-2] = '\0';
+				optarg++;
+			}
+			endpoints[nendpoints].host = optarg;
+			endpoints[nendpoints].service = value;
+			nendpoints++;
+			break;
+		case 'S':
+			use_standby = 1;
+			break;
+		case 'p':
+			pace_budget = atoi (optarg);
+			break;
+		case 'b':
+			pace_baud = atoi (optarg);
+			break;
+		case 'g':
+			frame_gap = atof (optarg) * 1000;
+			break;
+		case 'm':
+			frame_max = atoi (optarg);
+			if (frame_max < 1 || frame_max > sizeof (framebuf))
+				frame_max = sizeof (framebuf);
+			break;
+		case 'i':
+			idle_timeout = atoi (optarg);
+			break;
+		case 'U':
+			unix_path = optarg;
+			break;
+		case 'C':
+			cpu = atoi (optarg);
+			break;
+		case 'F':
+			rt_priority = atoi (optarg);
+			break;
+		case 'M':
+			lock_memory = 1;
+			break;
+		case 'B':
+			busy_poll = atoi (optarg);
+			break;
+		case 'r':
+			if (strcmp (optarg, "always") == 0) {
+				restart_policy = RESTART_ALWAYS;
+			} else if (strcmp (optarg, "on-failure") == 0) {
+				restart_policy = RESTART_ON_FAILURE;
+			} else if (strcmp (optarg, "never") == 0) {
+				restart_policy = RESTART_NEVER;
+			} else {
+				fprintf (stderr, "Bad restart policy: '%s'. Expected always, on-failure or never.\n", optarg);
+				return 2;
 			}
+			break;
+		default:
+			argc = 0;
 		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc < 3) {
+		fprintf (stderr, "Usage: %s [-z] [-Z <ms>] [-s <setting>=<value> ...] [-w [-t <ms>]] [-n <fd>] "
+		                 "[-T <ms>] [-H <ms> [-a]] [-e <host>:<port> ...] [-S] "
+		                 "[-p <ms> [-b <baud>]] [-g <chars> [-m <bytes>]] [-r <policy>] [-i <ms>] [-U <path>] "
+		                 "[-C <cpu>] [-F <priority>] [-M] [-B <us>] "
+		                 "<host> <port> [<link>|--] <command> ...]\n", prog);
+		return 2;
+	}
+
+	endpoints[0].host = argv[1];
+	endpoints[0].service = argv[2];
+
+	if (realtime () == -1)
+		return 1;
+
+	pfd[0].fd = -1; /* Will be (re)opened on demand. */
+	pfd[2].fd = -1;
+	pfd[3].fd = -1;
+	pfd[4].fd = -1;
+
+	if (unix_path) {
+		pfd[1].fd = -1; /* Until a user connects. */
+		if (listen_unix () == -1)
+			return 1;
 	} else {
-		/* Just print the PTY name. */
-		printf ("%s\n", ptsname (pfd[1].fd));
+		if (open_pty () == -1)
+			return 1;
+	}
+
+	if (wait_ready) {
+		/* Publish the PTY once the connection is ready. */
+		if (ready_timeout != -1)
+			ready_at = now () + ready_timeout;
+	} else if (publish (argc, argv) == -1) {
+		return 1;
 	}
 
+	/* The command delays are reported on SIGUSR1. */
+	sa.sa_handler = request_report;
+	sigemptyset (&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction (SIGUSR1, &sa, NULL);
+
 	while (1) {
-		if (pid) {
-			/* We're running a command. */
-			res = waitpid (pid, &status, pfd[1].fd == -1 ? 0 : WNOHANG);
-			if (res == -1) {
-				perror ("waitpid");
-				return 1;
-			}
+		if (report_requested) {
+			report_requested = 0;
+			report ();
+		}
 
-			if (res == pid)
-				return WEXITSTATUS (status);
+		/* Nobody has been using the PTY for a while. */
+		if (idle_at != -1 && now () >= idle_at) {
+			idle_at = -1;
+			if (pfd[2].fd != -1)
+				standby_hangup ();
+			if (pfd[0].fd != -1) {
+				fprintf (stderr, "Idle, disconnecting from %s:%s\n",
+					endpoints[active.endpoint].host, endpoints[active.endpoint].service);
+				hangup ();
+			}
 		}
 
-		/* Process the data from the telnet server.
-		 * If just one character was consumed, then the other IAC has
-		 * to be left verbatim. */
-		while ((res = get_esc (inbuf, inbytes, NULL)) > 1) {
-			inbytes -= res;
-			memmove (inbuf, &inbuf[res], inbytes);
-		};
+		/* Run the command again. */
+		if (restart_at != -1 && now () >= restart_at) {
+			restart_at = -1;
+			if (spawn (argc, argv) == -1)
+				return 1;
+		}
 
+		process_input ();
+		while (frame_gap != -1 && collect_frame ())
+			process_input ();
 
 		/* The telnet server side. Connect or reconnect to it. */
-		if (pfd[0].fd == -1)
-			pfd[0].fd = get_socket (argv[1], argv[2]);
+		if (pfd[0].fd == -1 && wanted () && (retry_at == -1 || now () >= retry_at)) {
+			pfd[0].fd = connect_active ();
+			if (pfd[0].fd == -1)
+				retry_at = now () + RETRY_DELAY;
+			else
+				retry_at = -1;
+		}
+
+		/* Check that the server is still there. Only if we've been
+		 * reading, otherwise the deadline has been pushed back. */
+		if (pfd[0].fd != -1 && pfd[0].events & POLLIN && reply_by != -1 && now () >= reply_by) {
+			fprintf (stderr, "%s:%s: No reply\n",
+				endpoints[active.endpoint].host, endpoints[active.endpoint].service);
+			hangup ();
+			continue;
+		}
+
+		/* Keep the standby connection to a different server. */
+		if (pfd[2].fd != -1 && pfd[0].fd != -1 && standby.endpoint == active.endpoint)
+			standby_hangup ();
+		if (use_standby && published && pfd[0].fd != -1 && pfd[2].fd == -1)
+			standby_connect ();
+		if (pfd[0].fd != -1 && !active.connecting)
+			probe ();
+
+		if (!published) {
+			if (pfd[0].fd != -1 && !active.connecting && !active.negotiating && !active.pending) {
+				if (publish (argc, argv) == -1)
+					return 1;
+			} else if (ready_at != -1 && now () >= ready_at) {
+				fprintf (stderr, "Timed out waiting for %s:%s\n", argv[1], argv[2]);
+				return 1;
+			}
+		}
+
+		if (mccp.deflating)
+			deflate_output ();
 		pfd[0].events = 0;
-		if (inbytes < sizeof (inbuf) && outbytes == 0)
-			pfd[0].events |= POLLIN;
-		if (outbytes)
+		if (active.connecting || outbytes || ctl_ready ())
 			pfd[0].events |= POLLOUT;
+		/* Keep reading while the reply to the probe is due, even with
+		 * the output waiting, so that a server that stopped reading
+		 * is noticed. What followed the end of the compressed stream
+		 * goes to the input buffer first. */
+		if (!active.connecting && (!(pfd[0].events & POLLOUT) || reply_by != -1)) {
+			if (mccp.inflating ? zinbytes < sizeof (inbuf) : inbytes < sizeof (inbuf) && zinbytes == 0)
+				pfd[0].events |= POLLIN;
+		}
 		pfd[0].revents = 0;
 
-		/* PTY side. */
+		/* The reply can't arrive while we're not reading, because the
+		 * input buffer is full. */
+		if (reply_by != -1 && !(pfd[0].events & POLLIN))
+			reply_by = now () + reply_wait ();
+
+		/* Wake up to flush the compressor, reconnect or give up. */
+		timeout = -1;
+		if (mccp.deflating && outbytes < sizeof (outbuf))
+			set_timeout (&timeout, flush_at);
+		if (pfd[0].fd == -1) {
+			if (wanted ())
+				set_timeout (&timeout, retry_at);
+		} else if (!active.connecting) {
+			if (heartbeat != -1 && reply_by == -1)
+				set_timeout (&timeout, active_at + heartbeat);
+			set_timeout (&timeout, reply_by);
+		}
+		if (use_standby && pfd[0].fd != -1 && pfd[2].fd == -1)
+			set_timeout (&timeout, standby_retry_at);
+		set_timeout (&timeout, idle_at);
+		if (!published)
+			set_timeout (&timeout, ready_at);
+		set_timeout (&timeout, restart_at);
+
+		/* Standby server side. */
+		pfd[2].events = standby.connecting ? POLLOUT : POLLIN;
+		pfd[2].revents = 0;
+
+		/* The command and the PTY users. */
+		pfd[3].events = POLLIN;
+		pfd[3].revents = 0;
+		pfd[4].events = POLLIN;
+		pfd[4].revents = 0;
+
+		/* PTY side. Leave the data there if the serial port is behind. */
+		room = pace_room (&pace_at);
+		if (room == 0)
+			set_timeout (&timeout, pace_at);
 		pfd[1].events = 0;
-		if (outbytes < sizeof (outbuf) / 2 && inbytes == 0)
+		if (tx_room () > sizeof (outbuf) / 2 && inbytes == 0 && room != 0)
 			pfd[1].events |= POLLIN;
-		if (inbytes >= 1 && inbuf[0] != IAC)
-			pfd[1].events |= POLLOUT;
-		if (inbytes >= 2 && inbuf[0] == IAC && inbuf[1] == IAC)
-			pfd[1].events |= POLLOUT;
+		if (frame_gap != -1) {
+			/* Hold the frame until it's complete. */
+			if (framebytes >= frame_max || (framebytes && now () >= frame_at))
+				pfd[1].events |= POLLOUT;
+			else if (framebytes)
+				set_timeout (&timeout, frame_at);
+		} else {
+			if (inbytes >= 1 && inbuf[0] != IAC)
+				pfd[1].events |= POLLOUT;
+			if (inbytes >= 2 && inbuf[0] == IAC && inbuf[1] == IAC)
+				pfd[1].events |= POLLOUT;
+		}
+		if (!unix_path) {
+			/* Once nobody has it open, only pick up what's been
+			 * left there. The data for it wait for the next user. */
+			if (pty_state != PTY_OPEN)
+				pfd[1].events &= POLLIN;
+			if (pty_state == PTY_UNUSED || pfd[1].events == 0)
+				pfd[1].fd = -1;
+			else
+				pfd[1].fd = pty_fd;
+		}
 		pfd[1].revents = 0;
 
-		/* Get the events. */
-		res = poll (pfd, sizeof (pfd) / sizeof (pfd[0]), -1);
+		/* Get the events. The PTY is not watched until it's published. */
+		res = wait_events (published ? 5 : 1, timeout);
+		if (res == -1 && errno == EINTR)
+			continue;
 		if (res == -1) {
 			perror ("poll");
 			return -1;
 		}
 
+		/* The connection to the telnet server has been made or not. */
+		if (active.connecting && pfd[0].revents) {
+			if (finish_socket (pfd[0].fd) == -1) {
+				hangup ();
+				retry_at = now () + RETRY_DELAY;
+			} else {
+				active.connecting = 0;
+				connected ();
+			}
+			pfd[0].revents = 0;
+		}
+
 		/* Data from telnet server. */
 		if (pfd[0].revents & POLLIN) {
-			res = read (pfd[0].fd, &inbuf[inbytes], sizeof (inbuf) - inbytes);
+			if (mccp.inflating)
+				res = receive (&zinbuf[zinbytes], sizeof (inbuf) - zinbytes);
+			else
+				res = receive (&inbuf[inbytes], sizeof (inbuf) - inbytes);
 			if (res > 0) {
-				inbytes += res;
+				if (mccp.inflating)
+					zinbytes += res;
+				else
+					inbytes += res;
+				active_at = now ();
 			} else {
 				if (res == -1) {
 					perror ("read");
 					inbytes = 0;
 				}
-				close (pfd[0].fd);
-				pfd[0].fd = -1;
+				hangup ();
 			}
 		}
 
 		/* Data for the telnet server. */
-		if (pfd[0].revents & POLLOUT) {
-			res = write (pfd[0].fd, outbuf, outbytes);
+		if (pfd[0].fd != -1 && pfd[0].revents & POLLOUT) {
+			res = send_output ();
 			if (res > 0) {
-				outbytes -= res;
-				memmove (outbuf, &outbuf[res], outbytes);
+				active_at = now ();
 			} else {
 				if (res == -1)
 					perror ("write");
-				close (pfd[0].fd);
-				pfd[0].fd = -1;
+				hangup ();
 			}
 		}
 
 		/* Telnet has gone off. */
-		if (pfd[0].revents & POLLHUP) {
-			close (pfd[0].fd);
-			pfd[0].fd = -1;
+		if (pfd[0].fd != -1 && pfd[0].revents & (POLLHUP | POLLERR))
+			hangup ();
+
+		/* The standby telnet server. */
+		if (pfd[2].fd != -1 && pfd[2].revents)
+			standby_event ();
+
+		/* Someone opened the PTY, or connected. */
+		if (pfd[4].revents & POLLIN) {
+			if (unix_path)
+				accept_user ();
+			else
+				users_event ();
+		}
+
+		/* The command has terminated. */
+		if (pid && pfd[3].revents & POLLIN) {
+			res = child_event ();
+			if (res != -1)
+				return res;
 		}
 
 		/* Data from pty. */
 		if (pfd[1].revents & POLLIN) {
-			res = read (pfd[1].fd, &outbuf[outbytes], sizeof (outbuf) / 2 - outbytes);
+			unsigned char buf[sizeof (outbuf) / 2];
+
+			res = tx_room () / 2;
+			if (room != -1 && room < res)
+				res = room;
+			res = read (pfd[1].fd, buf, res);
 			if (res > 0) {
-				for (i = outbytes; i < outbytes + res; i++) {
-					/* If there's a IAC, double it. */
-					if (outbuf[i] == IAC)
-						memmove (&outbuf[i+1], &outbuf[i], res - i);
-				}
-				outbytes += res;
+				/* If there's a IAC, double it. */
+				transmit (buf, res);
+				if (room != -1)
+					in_flight += res * 1000LL;
+			} else if (unix_path) {
+				if (res == 0 || errno != EAGAIN)
+					drop_user ();
 			} else {
 				close (pfd[1].fd);
 				if (res == -1) {
@@ -194,8 +1890,28 @@ main (int argc, char *argv[])
 			}
 		}
 
+		/* A frame to pty. */
+		if (pfd[1].revents & POLLOUT && frame_gap != -1) {
+			res = write (pfd[1].fd, framebuf, framebytes);
+			if (res > 0) {
+				framebytes -= res;
+				memmove (framebuf, &framebuf[res], framebytes);
+			} else if (unix_path) {
+				if (res == 0 || errno != EAGAIN)
+					drop_user ();
+			} else {
+				close (pfd[1].fd);
+				pfd[1].fd = -1;
+				if (res == -1) {
+					perror ("write");
+					return 1;
+				}
+				return -1;
+			}
+		}
+
 		/* Data to pty. */
-		if (pfd[1].revents & POLLOUT) {
+		if (pfd[1].revents & POLLOUT && frame_gap == -1) {
 			/* Only up to a an IAC. */
 			res = get_data (inbuf, inbytes);
 			res = write (pfd[1].fd, inbuf, res);
@@ -206,6 +1922,9 @@ main (int argc, char *argv[])
 				}
 				inbytes -= res;
 				memmove (inbuf, &inbuf[res], inbytes);
+			} else if (unix_path) {
+				if (res == 0 || errno != EAGAIN)
+					drop_user ();
 			} else {
 				close (pfd[1].fd);
 				pfd[1].fd = -1;
@@ -218,17 +1937,13 @@ main (int argc, char *argv[])
 			}
 		}
 
-		/* The PTY has been hung up. */
-		if (pfd[1].revents & POLLHUP) {
-			if (pid) {
-				/* From now on the waitpid will be blocking. */
-				close (pfd[1].fd);
-				pfd[1].fd = -1;
-			} else {
-				/* Allow other clients. */
-				unlockpt (pfd[1].fd);
-			}
-		}
+		/* Nobody has the PTY open, or the user of the UNIX socket
+		 * went away. What it sent and we haven't read is lost. */
+		if (unix_path && pfd[1].fd != -1 && pfd[1].revents & (POLLHUP | POLLERR)
+		    && !(pfd[1].revents & POLLIN))
+			drop_user ();
+		else if (!unix_path && pfd[1].revents & POLLHUP)
+			pty_hangup ();
 	}
 
 	/* Not reached really. */
@@ -10,28 +10,29 @@
 
 #include <poll.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
-#include <strings.h>
 #include <unistd.h>
 
 #include "common.h"
 
+/* The value is -1 if we do not care, otherwise it is sent to the server.
+ * If it's the one that requests the setting, we wait for the reply. */
 struct {
 	enum com_port_option option;
 	int received;
 	int requested;
 	int control;
+	int value;
 } options[] = {
-	{ .option = SET_BAUDRATE },
-	{ .option = SET_DATASIZE },
-	{ .option = SET_PARITY },
-	{ .option = SET_STOPSIZE },
-	{ .option = SET_CONTROL, .control = CONTROL_REQ_FLOW	},
-	{ .option = SET_CONTROL, .control = CONTROL_REQ_BREAK	},
-	{ .option = SET_CONTROL, .control = CONTROL_REQ_DTR	},
-	{ .option = SET_CONTROL, .control = CONTROL_REQ_RTS	},
-	{ .option = SET_CONTROL, .control = CONTROL_REQ_FLOW_IN	},
+	{ .option = SET_BAUDRATE, .value = -1 },
+	{ .option = SET_DATASIZE, .value = -1 },
+	{ .option = SET_PARITY, .value = -1 },
+	{ .option = SET_STOPSIZE, .value = -1 },
+	{ .option = SET_CONTROL, .control = CONTROL_REQ_FLOW, .value = -1	},
+	{ .option = SET_CONTROL, .control = CONTROL_REQ_BREAK, .value = -1	},
+	{ .option = SET_CONTROL, .control = CONTROL_REQ_DTR, .value = -1	},
+	{ .option = SET_CONTROL, .control = CONTROL_REQ_RTS, .value = -1	},
+	{ .option = SET_CONTROL, .control = CONTROL_REQ_FLOW_IN, .value = -1	},
 };
 int need_more;
 
@@ -148,21 +149,13 @@ got_option (enum com_port_option option, union com_port_option_value *value)
 int
 main (int argc, char *argv[])
 {
-	unsigned char inbuf[128], outbuf[128];
+	unsigned char inbuf[128], outbuf[256];
 	int inbytes = 0, outbytes = 0;
 	struct pollfd pfd;
-	/* -1 = do not care, 0 = request, non-zero = set */
-	int baudrate = -1;
-	int datasize = -1;
-	int parity = -1;
-	int stopsize = -1;
-	int control_flow = -1;
-	int control_break = -1;
-	int control_dtr = -1;
-	int control_rts = -1;
-	int control_flow_in = -1;
+	enum com_port_option option;
+	int value;
 	int res;
-	int i;
+	int i, j;
 
 	if (argc < 3 || argc % 2 == 0) {
 		fprintf (stderr, "Usage: %s <host> <port> [<setting> <value> ...]\n", argv[0]);
@@ -172,132 +165,21 @@ main (int argc, char *argv[])
 	for (i = 3; i < argc; i += 2) {
 		if (argv[i + 1][0] == '\0')
 			continue;
-		if (strcmp (argv[i], "baudrate") == 0) {
-			if (argv[i + 1][0] == '?') {
-				baudrate = 0;
-			} else if (argv[i + 1][0] >= '1' && argv[i + 1][0] <= '9') {
-				baudrate = atoi (argv[i + 1]);
-			} else {
-				fprintf (stderr, "Bad baudrate: '%s'. Expected a non-zero number or '?'.\n", argv[i + 1]);
-				return 2;
-			}
-		} else if (strcmp (argv[i], "datasize") == 0) {
-			if (argv[i + 1][0] == '?') {
-				datasize = 0;
-			} else if (argv[i + 1][0] >= '1' && argv[i + 1][0] <= '9') {
-				datasize = atoi (argv[i + 1]);
-			} else {
-				fprintf (stderr, "Bad datasize: '%s'. Expected a non-zero number or '?'.\n", argv[i + 1]);
-				return 2;
-			}
-		} else if (strcmp (argv[i], "parity") == 0) {
-			if (argv[i + 1][0] == '?') {
-				parity = 0;
-			} else if (argv[i + 1][0] >= '1' && argv[i + 1][0] <= '9') {
-				parity = atoi (argv[i + 1]);
-			} else if (strcasecmp (argv[i + 1], "NONE") == 0) {
-				parity = 1;
-			} else if (strcasecmp (argv[i + 1], "ODD") == 0) {
-				parity = 2;
-			} else if (strcasecmp (argv[i + 1], "EVEN") == 0) {
-				parity = 3;
-			} else if (strcasecmp (argv[i + 1], "MARK") == 0) {
-				parity = 4;
-			} else {
-				fprintf (stderr, "Bad parity: '%s'. Expected 'NONE', 'ODD', 'EVEN', 'MARK' or '?'.\n", argv[i + 1]);
-				return 2;
-			}
-		} else if (strcmp (argv[i], "stopsize") == 0) {
-			if (argv[i + 1][0] == '?') {
-				stopsize = 0;
-			} else if (argv[i + 1][0] >= '1' && argv[i + 1][0] <= '9') {
-				stopsize = atoi (argv[i + 1]);
-			} else {
-				fprintf (stderr, "Bad stopsize: '%s'. Expected a non-zero number or '?'.\n", argv[i + 1]);
-				return 2;
-			}
-		} else if (strcmp (argv[i], "flow") == 0) {
-			if (argv[i + 1][0] == '?') {
-				control_flow = 0;
-			} else if (strcmp (argv[i + 1], "none") == 0) {
-				control_flow = 1;
-			} else if (strcmp (argv[i + 1], "xonxoff") == 0) {
-				control_flow = 2;
-			} else if (strcmp (argv[i + 1], "rtscts") == 0) {
-				control_flow = 3;
-			} else {
-				fprintf (stderr, "Bad flow: '%s'. Expected 'none', 'xonxoff', 'rtscts' or '?'.\n", argv[i + 1]);
-				return 2;
-			}
-		} else if (strcmp (argv[i], "break") == 0) {
-			if (argv[i + 1][0] == '?') {
-				control_break = 0;
-			} else if (strcmp (argv[i + 1], "on") == 0) {
-				control_break = 5;
-			} else if (strcmp (argv[i + 1], "off") == 0) {
-				control_break = 6;
-			} else {
-				fprintf (stderr, "Bad break: '%s'. Expected 'on', 'off' or '?'.\n", argv[i + 1]);
-				return 2;
-			}
-		} else if (strcmp (argv[i], "dtr") == 0) {
-			if (argv[i + 1][0] == '?') {
-				control_dtr = 0;
-			} else if (strcmp (argv[i + 1], "on") == 0) {
-				control_dtr = 8;
-			} else if (strcmp (argv[i + 1], "off") == 0) {
-				control_dtr = 9;
-			} else {
-				fprintf (stderr, "Bad dtr: '%s'. Expected 'on', 'off' or '?'.\n", argv[i + 1]);
-				return 2;
-			}
-		} else if (strcmp (argv[i], "rts") == 0) {
-			if (argv[i + 1][0] == '?') {
-				control_rts = 0;
-			} else if (strcmp (argv[i + 1], "on") == 0) {
-				control_rts = 11;
-			} else if (strcmp (argv[i + 1], "off") == 0) {
-				control_rts = 12;
-			} else {
-				fprintf (stderr, "Bad rts: '%s'. Expected 'on', 'off' or '?'.\n", argv[i + 1]);
-				return 2;
-			}
-		} else if (strcmp (argv[i], "flow_in") == 0) {
-			if (argv[i + 1][0] == '?') {
-				control_flow_in = 0;
-			} else if (strcmp (argv[i + 1], "none") == 0) {
-				control_flow_in = 14;
-			} else if (strcmp (argv[i + 1], "xonxoff") == 0) {
-				control_flow_in = 15;
-			} else if (strcmp (argv[i + 1], "rtscts") == 0) {
-				control_flow_in = 16;
-			} else if (strcmp (argv[i + 1], "dtr") == 0) {
-				control_flow_in = 18;
-			} else if (strcmp (argv[i + 1], "dcd") == 0) {
-				control_flow_in = 17;
-			} else if (strcmp (argv[i + 1], "dsr") == 0) {
-				control_flow_in = 19;
-			} else {
-				fprintf (stderr, "Bad flow_in: '%s'. Expected 'none', 'xonxoff', 'rtscts', 'dtr', 'dcd', 'dsr' or '?'.\n", argv[i + 1]);
-				return 2;
-			}
-		} else {
-			fprintf (stderr, "YOLO: [%s] [%s]\n", argv[i], argv[i + 1]);
+		if (parse_setting (argv[i], argv[i + 1], &option, &value) == -1)
 			return 2;
+		for (j = 0; j < sizeof(options) / sizeof(options[0]); j++) {
+			if (options[j].option != option)
+				continue;
+			if (option == SET_CONTROL && control_to_req (value) != options[j].control)
+				continue;
+			options[j].value = value;
 		}
 	}
 
 	if (argc == 3) {
 		/* Request all if no arguments. */
-		baudrate = 0;
-		datasize = 0;
-		parity = 0;
-		stopsize = 0;
-		control_flow = 0;
-		control_break = 0;
-		control_dtr = 0;
-		control_rts = 0;
-		control_flow_in = 0;
+		for (i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+			options[i].value = options[i].option == SET_CONTROL ? options[i].control : 0;
 	}
 
 	pfd.fd = get_socket (argv[1], argv[2]);
@@ -309,101 +191,13 @@ main (int argc, char *argv[])
 	outbuf[outbytes++] = COM_PORT_OPTION;
 
 	for (i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
-		int control_val;
-
-		switch (options[i].option) {
-		case SET_BAUDRATE:
-			if (baudrate == -1)
-				continue;
-			else if (baudrate == 0)
-				options[i].requested = 1;
-			outbuf[outbytes++] = IAC;
-			outbuf[outbytes++] = SB;
-			outbuf[outbytes++] = COM_PORT_OPTION;
-			outbuf[outbytes++] = SET_BAUDRATE;
-			outbuf[outbytes++] = (baudrate >> 24) & 0xff;
-			outbuf[outbytes++] = (baudrate >> 16) & 0xff;
-			outbuf[outbytes++] = (baudrate >>  8) & 0xff;
-			outbuf[outbytes++] = (baudrate >>  0) & 0xff;
-			outbuf[outbytes++] = IAC;
-			outbuf[outbytes++] = SE;
-			break;
-		case SET_DATASIZE:
-			if (datasize == -1)
-				continue;
-			else if (datasize == 0)
-				options[i].requested = 1;
-			outbuf[outbytes++] = IAC;
-			outbuf[outbytes++] = SB;
-			outbuf[outbytes++] = COM_PORT_OPTION;
-			outbuf[outbytes++] = SET_DATASIZE;
-			outbuf[outbytes++] = datasize;
-			outbuf[outbytes++] = IAC;
-			outbuf[outbytes++] = SE;
-			break;
-		case SET_PARITY:
-			if (parity == -1)
-				continue;
-			else if (parity == 0)
-				options[i].requested = 1;
-			outbuf[outbytes++] = IAC;
-			outbuf[outbytes++] = SB;
-			outbuf[outbytes++] = COM_PORT_OPTION;
-			outbuf[outbytes++] = SET_PARITY;
-			outbuf[outbytes++] = parity;
-			outbuf[outbytes++] = IAC;
-			outbuf[outbytes++] = SE;
-			break;
-		case SET_STOPSIZE:
-			if (stopsize == -1)
-				continue;
-			else if (stopsize == 0)
-				options[i].requested = 1;
-			outbuf[outbytes++] = IAC;
-			outbuf[outbytes++] = SB;
-			outbuf[outbytes++] = COM_PORT_OPTION;
-			outbuf[outbytes++] = SET_STOPSIZE;
-			outbuf[outbytes++] = stopsize;
-			outbuf[outbytes++] = IAC;
-			outbuf[outbytes++] = SE;
-			break;
-		case SET_CONTROL:
-			switch (options[i].control) {
-			case CONTROL_REQ_FLOW:
-				control_val = control_flow;
-				break;
-			case CONTROL_REQ_BREAK:
-				control_val = control_break;
-				break;
-			case CONTROL_REQ_DTR:
-				control_val = control_dtr;
-				break;
-			case CONTROL_REQ_RTS:
-				control_val = control_rts;
-				break;
-			case CONTROL_REQ_FLOW_IN:
-				control_val = control_flow_in;
-				break;
-			default:
-				control_val = -1;
-			}
-			if (control_val == -1) {
-				continue;
-			} else if (control_val == 0) {
-				control_val = options[i].control;
-				options[i].requested = 1;
-			}
-			outbuf[outbytes++] = IAC;
-			outbuf[outbytes++] = SB;
-			outbuf[outbytes++] = COM_PORT_OPTION;
-			outbuf[outbytes++] = SET_CONTROL;
-			outbuf[outbytes++] = control_val;
-			outbuf[outbytes++] = IAC;
-			outbuf[outbytes++] = SE;
-			break;
-		default:
-			break;
-		}
+		if (options[i].value == -1)
+			continue;
+		if (options[i].option == SET_CONTROL)
+			options[i].requested = options[i].value == options[i].control;
+		else
+			options[i].requested = options[i].value == 0;
+		outbytes += put_com_port_option (&outbuf[outbytes], options[i].option, options[i].value);
 		need_more += options[i].requested;
 	};
 
@@ -460,7 +254,7 @@ main (int argc, char *argv[])
 
 		while (inbytes) {
 			/* Process the commands. */
-			while ((res = get_esc (inbuf, inbytes, got_option)) > 0) {
+			while ((res = get_esc (inbuf, inbytes, got_option, NULL)) > 0) {
 				inbytes -= res;
 				memmove (inbuf, &inbuf[res], inbytes);
 			};
@@ -0,0 +1,305 @@
+/*
+ * Serial port over Telnet protocol codec
+ * Lubomir Rintel <lkundrak@v3.sk>
+ * License: GPL
+ *
+ * Everything here is inline and allocates nothing. When the handlers
+ * passed to rfc2217_get_esc() are known at compile time, the compiler
+ * is free to inline them into the decoder. The out-of-line interface
+ * with plain callbacks is in common.h and the libnets library.
+ */
+
+#pragma once
+
+enum {
+	COM_PORT_OPTION = 44,
+	COMPRESS2	= 86,
+	COMPRESS3	= 87,
+
+	SE	= 240,
+	NOP	= 241,
+	DATA	= 242,
+	BRK	= 243,
+	IP	= 244,
+	AO	= 245,
+	AYT	= 246,
+	EC	= 247,
+	EL	= 248,
+	GA	= 249,
+	SB	= 250,
+	WILL	= 251,
+	WONT	= 252,
+	DO	= 253,
+	DONT	= 254,
+	IAC	= 255,
+};
+
+/* The server adds 100 to these in its replies. */
+enum com_port_option {
+	SIGNATURE		= 0 ,
+	SET_BAUDRATE		= 1 ,
+	SET_DATASIZE		= 2 ,
+	SET_PARITY		= 3 ,
+	SET_STOPSIZE		= 4 ,
+	SET_CONTROL		= 5 ,
+	NOTIFY_LINESTATE	= 6 ,
+	NOTIFY_MODEMSTATE	= 7 ,
+	FLOWCONTROL_SUSPEND	= 8 ,
+	FLOWCONTROL_RESUME	= 9 ,
+	SET_LINESTATE_MASK	= 10 ,
+	SET_MODEMSTATE_MASK	= 11 ,
+	PURGE_DATA		= 12 ,
+};
+
+enum {
+	CONTROL_REQ_FLOW	= 0,
+	CONTROL_REQ_BREAK	= 4,
+	CONTROL_REQ_DTR		= 7,
+	CONTROL_REQ_RTS		= 10,
+	CONTROL_REQ_FLOW_IN	= 13,
+	CONTROL_REQ_RESERVED	= 20,
+};
+
+union com_port_option_value {
+	struct {
+		int size;
+		char *str;
+	} signature;
+	int baudrate;
+	int datasize;
+	int stopsize;
+	int parity;
+	int control;
+	int linestate;
+	int modemstate;
+	int mask;
+	int purge;
+};
+
+/* Longest subnegotiation payload that is decoded, the longer signatures
+ * are truncated. */
+#define RFC2217_SB_MAX 256
+
+/* Longest subnegotiation rfc2217_put() produces for a signature of
+ * given length. All other ones fit into RFC2217_PUT_MAX (0). */
+#define RFC2217_PUT_MAX(size) (4 + 2 * ((size) > 4 ? (size) : 4) + 2)
+
+typedef void (rfc2217_option_handler)(void *data, enum com_port_option option, union com_port_option_value *value);
+
+/* Called with WILL, WONT, DO or DONT and the option, or with SB and the
+ * option of a subnegotiation other than the COM_PORT_OPTION one. */
+typedef void (rfc2217_negotiate_handler)(void *data, int command, int option);
+
+static inline int
+control_to_req (int control)
+{
+	if (control < CONTROL_REQ_BREAK)
+		return CONTROL_REQ_FLOW;
+	if (control < CONTROL_REQ_DTR)
+		return CONTROL_REQ_BREAK;
+	if (control < CONTROL_REQ_RTS)
+		return CONTROL_REQ_DTR;
+	if (control < CONTROL_REQ_FLOW_IN)
+		return CONTROL_REQ_RTS;
+	if (control < CONTROL_REQ_RESERVED)
+		return CONTROL_REQ_FLOW_IN;
+	return CONTROL_REQ_RESERVED;
+}
+
+/* Decode the COM_PORT_OPTION subnegotiation payload, with the IACs
+ * already undoubled. Both the client and the server codes are accepted.
+ * The buffer needs to have room for one more byte, where the signature
+ * is terminated. */
+static inline void
+rfc2217_com_port_option (unsigned char *buf, int size, rfc2217_option_handler *handler, void *data)
+{
+	union com_port_option_value value;
+	enum com_port_option option;
+
+	if (size < 1)
+		return;
+	option = (enum com_port_option)(buf[0] >= 100 ? buf[0] - 100 : buf[0]);
+
+	switch (option) {
+	case SIGNATURE:
+		/* There's always room for the terminator. */
+		value.signature.size = size - 1;
+		value.signature.str = (char *)&buf[1];
+		buf[size] = '\0';
+		break;
+	case SET_BAUDRATE:
+		if (size < 5)
+			return;
+		value.baudrate = (buf[1] << 24) | (buf[2] << 16) | (buf[3] << 8) | (buf[4] << 0);
+		break;
+	case FLOWCONTROL_SUSPEND:
+	case FLOWCONTROL_RESUME:
+		break;
+	case SET_DATASIZE:
+	case SET_PARITY:
+	case SET_STOPSIZE:
+	case SET_CONTROL:
+	case NOTIFY_LINESTATE:
+	case NOTIFY_MODEMSTATE:
+	case SET_LINESTATE_MASK:
+	case SET_MODEMSTATE_MASK:
+	case PURGE_DATA:
+		if (size < 2)
+			return;
+		/* All of these are a single byte. */
+		value.control = buf[1];
+		break;
+	default:
+		return;
+	}
+
+	handler (data, option, &value);
+}
+
+/* Decode the command at the start of the buffer. Returns the number of
+ * bytes consumed, or 0 if there's not a complete command there. An IAC IAC
+ * is not a command, but a data byte. */
+static inline int
+rfc2217_get_esc (const unsigned char *buf, int size,
+                 rfc2217_option_handler *handler,
+                 rfc2217_negotiate_handler *negotiate,
+                 void *data)
+{
+	unsigned char val[RFC2217_SB_MAX + 1];
+	int len;
+	int i;
+
+	if (size < 2)
+		return 0;
+
+	if (buf[0] != IAC)
+		return 0;
+
+	switch (buf[1]) {
+	case IAC:
+		/* If we leave IAC IAC, then it's considered as IAC data. */
+		return 0;
+	case WILL:
+	case WONT:
+	case DO:
+	case DONT:
+		if (size < 3)
+			return 0;
+		if (negotiate)
+			negotiate (data, buf[1], buf[2]);
+		return 3;
+	case SB:
+		for (i = 2; i + 1 < size; i++) {
+			if (buf[i] != IAC)
+				continue;
+			if (buf[i + 1] == SE)
+				break;
+			/* A doubled IAC. */
+			i++;
+		}
+		if (i + 1 >= size)
+			return 0;
+		if (i < 3)
+			return i + 2;
+
+		if (buf[2] == COM_PORT_OPTION) {
+			if (handler == 0)
+				return i + 2;
+			len = 0;
+			for (i = 3; !(buf[i] == IAC && buf[i + 1] == SE); i++) {
+				if (len < RFC2217_SB_MAX)
+					val[len++] = buf[i];
+				if (buf[i] == IAC)
+					i++;
+			}
+			rfc2217_com_port_option (val, len, handler, data);
+		} else if (negotiate) {
+			negotiate (data, SB, buf[2]);
+		}
+		return i + 2;
+	}
+
+	/* Unknown code. Just consume the IAC and command. */
+	return 2;
+}
+
+/* Find how much of the data at the start of the buffer can be passed on.
+ * If the first character is an IAC after the previous get_esc() call
+ * it is not a command. */
+static inline int
+rfc2217_get_data (const unsigned char *buf, int size)
+{
+	int i;
+
+	if (size == 0)
+		return 0;
+	if (size >= 2 && buf[0] == IAC && buf[1] == IAC)
+		return 1;
+	for (i = 0; i < size; i++) {
+		if (buf[i] == IAC)
+			break;
+	}
+
+	return i;
+}
+
+/* Encode a command, such as WILL COM_PORT_OPTION. Always 3 bytes. */
+static inline int
+rfc2217_put_command (unsigned char *buf, int command, int option)
+{
+	buf[0] = IAC;
+	buf[1] = command;
+	buf[2] = option;
+	return 3;
+}
+
+/* Encode a COM_PORT_OPTION subnegotiation, doubling the IACs. The server
+ * passes the option code with 100 added. Returns the length, which is at
+ * most RFC2217_PUT_MAX(signature size). */
+static inline int
+rfc2217_put (unsigned char *buf, int code, const union com_port_option_value *value)
+{
+	const unsigned char *str = 0;
+	unsigned char val[4];
+	int size = 0;
+	int len = 0;
+	int i;
+
+	switch ((enum com_port_option)(code >= 100 ? code - 100 : code)) {
+	case SIGNATURE:
+		str = (const unsigned char *)value->signature.str;
+		len = value->signature.size;
+		break;
+	case SET_BAUDRATE:
+		val[0] = (value->baudrate >> 24) & 0xff;
+		val[1] = (value->baudrate >> 16) & 0xff;
+		val[2] = (value->baudrate >>  8) & 0xff;
+		val[3] = (value->baudrate >>  0) & 0xff;
+		len = 4;
+		break;
+	case FLOWCONTROL_SUSPEND:
+	case FLOWCONTROL_RESUME:
+		break;
+	default:
+		/* All others are a single byte. */
+		val[0] = value->control;
+		len = 1;
+		break;
+	}
+	if (str == 0)
+		str = val;
+
+	buf[size++] = IAC;
+	buf[size++] = SB;
+	buf[size++] = COM_PORT_OPTION;
+	buf[size++] = code;
+	for (i = 0; i < len; i++) {
+		buf[size++] = str[i];
+		if (str[i] == IAC)
+			buf[size++] = IAC;
+	}
+	buf[size++] = IAC;
+	buf[size++] = SE;
+
+	return size;
+}